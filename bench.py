@@ -0,0 +1,268 @@
+#!/usr/bin/env python3
+##########################################################################
+#                                  _   _ ____  _
+#  Project                     ___| | | |  _ \| |
+#                             / __| | | | |_) | |
+#                            | (__| |_| |  _ <| |___
+#                             \___|\___/|_| \_\_____|
+#
+# Copyright (C) Daniel Stenberg, <daniel@haxx.se>, et al.
+#
+# This software is licensed as described in the file COPYING, which
+# you should have received as part of this distribution. The terms
+# are also available at https://curl.se/docs/copyright.html.
+#
+# You may opt to use, copy, modify, merge, publish, distribute and/or sell
+# copies of the Software, and permit persons to whom the Software is
+# furnished to do so, under the terms of the COPYING file.
+#
+# This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+# KIND, either express or implied.
+#
+# SPDX-License-Identifier: curl
+#
+##########################################################################
+
+# Throughput benchmarks. Generates URL corpora, runs trurl over them with
+# --url-file in the main modes and reports URLs/sec, ns/URL, allocations per
+# URL and peak RSS. The cost of starting trurl, measured with an empty input
+# file, is subtracted from the per URL numbers.
+#
+# Allocations are counted when scripts/malloccount.so (built by 'make bench')
+# exists, and shown as '-' otherwise.
+
+import sys
+import os
+import json
+import random
+import tempfile
+import time
+from os import path
+from subprocess import DEVNULL, Popen
+
+PROGNAME = "trurl"
+MALLOCCOUNT = "scripts/malloccount.so"
+
+EXIT_SUCCESS = 0
+EXIT_ERROR = 1
+
+DEFAULT_COUNT = 20000
+DEFAULT_RUNS = 3
+
+WORDS = ["alpha", "beta", "gamma", "delta", "curl", "trurl", "index", "img",
+         "search", "api", "v1", "v2", "users", "items", "static", "blog"]
+TLDS = ["com", "org", "net", "se", "io", "dev"]
+IDNS = ["räksmörgås", "bücher", "例え", "пример", "ελληνικά", "mañana"]
+
+
+def word(rnd):
+    return rnd.choice(WORDS)
+
+
+def hostname(rnd):
+    return f"{word(rnd)}.{word(rnd)}.{rnd.choice(TLDS)}"
+
+
+def urlpath(rnd, segments):
+    return "/".join(word(rnd) for _ in range(segments))
+
+
+def query(rnd, pairs):
+    q = []
+    for i in range(pairs):
+        key = rnd.choice(["utm_source", "utm_medium", "utm_campaign", "id",
+                          "q", "page", "sort", "ref", word(rnd)])
+        q.append(f"{key}={word(rnd)}%20{rnd.randint(0, 99999)}")
+    return "&".join(q)
+
+
+def short_url(rnd):
+    return f"https://{hostname(rnd)}/{urlpath(rnd, rnd.randint(0, 3))}"
+
+
+def longquery_url(rnd):
+    return (f"https://{hostname(rnd)}/{urlpath(rnd, 2)}?"
+            f"{query(rnd, rnd.randint(20, 60))}")
+
+
+def idn_url(rnd):
+    return (f"http://{rnd.choice(IDNS)}.{rnd.choice(TLDS)}/"
+            f"{urlpath(rnd, 2)}?{query(rnd, 2)}")
+
+
+def ipv6_url(rnd):
+    groups = ":".join(f"{rnd.randint(0, 0xffff):x}" for _ in range(8))
+    return f"http://[{groups}]:{rnd.randint(1, 65535)}/{urlpath(rnd, 2)}"
+
+
+def userinfo_url(rnd):
+    return (f"ftp://{word(rnd)}%40{word(rnd)}:{word(rnd)}%3A{rnd.randint(0, 999)}"
+            f"@{hostname(rnd)}:2121/{urlpath(rnd, 3)}")
+
+
+CORPORA = {
+    "short": short_url,
+    "longquery": longquery_url,
+    "idn": idn_url,
+    "ipv6": ipv6_url,
+    "userinfo": userinfo_url,
+}
+
+MODES = {
+    "default": [],
+    "get": ["--get", "{host} {path} {query:q} {query:utm_source}"],
+    "json": ["--json"],
+    "trim": ["--trim", "query=utm_*"],
+    "sort-query": ["--sort-query"],
+    "iterate": ["--iterate", "scheme=http https ftp"],
+}
+
+
+def writecorpus(name, count, directory):
+    rnd = random.Random(name)
+    fname = path.join(directory, f"{name}.txt")
+    with open(fname, "w", encoding="utf-8") as f:
+        for _ in range(count):
+            f.write(CORPORA[name](rnd) + "\n")
+    return fname
+
+
+def readallocs(fname):
+    try:
+        with open(fname, encoding="utf-8") as f:
+            for line in f:
+                if line.startswith("allocs:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return None
+
+
+def runonce(cmd, env):
+    start = time.perf_counter()
+    proc = Popen(cmd, stdout=DEVNULL, stderr=DEVNULL, env=env)
+    _, status, usage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    # ru_maxrss is in kilobytes on Linux
+    return elapsed, usage.ru_maxrss
+
+
+# run a command 'runs' times, return the best time, the peak RSS and the
+# number of allocations
+def measure(cmd, runs, shim, countfile):
+    env = dict(os.environ)
+    best = None
+    rss = 0
+    for _ in range(runs):
+        elapsed, maxrss = runonce(cmd, env)
+        best = elapsed if best is None else min(best, elapsed)
+        rss = max(rss, maxrss)
+    allocs = None
+    if shim:
+        env["LD_PRELOAD"] = shim
+        env["MALLOCCOUNT"] = countfile
+        runonce(cmd, env)
+        allocs = readallocs(countfile)
+    return best, rss, allocs
+
+
+def main(argc, argv):
+    baseDir = path.dirname(path.realpath(argv[0]))
+    baseCmd = path.join(os.getcwd(), PROGNAME)
+    count = DEFAULT_COUNT
+    runs = DEFAULT_RUNS
+    corpora = list(CORPORA)
+    modes = list(MODES)
+    corpusfile = None
+    outfile = None
+
+    for arg in argv[1:]:
+        if arg.startswith("--trurl="):
+            baseCmd = arg[len("--trurl="):]
+        elif arg.startswith("--count="):
+            count = int(arg[len("--count="):])
+        elif arg.startswith("--runs="):
+            runs = int(arg[len("--runs="):])
+        elif arg.startswith("--corpus="):
+            corpora = arg[len("--corpus="):].split(",")
+        elif arg.startswith("--mode="):
+            modes = arg[len("--mode="):].split(",")
+        elif arg.startswith("--file="):
+            # a URL file of your own instead of the generated ones
+            corpusfile = arg[len("--file="):]
+        elif arg.startswith("--output="):
+            outfile = arg[len("--output="):]
+        else:
+            print(f"usage: {argv[0]} [--trurl=PATH] [--count=N] [--runs=N] "
+                  "[--corpus=a,b] [--mode=a,b] [--file=URLFILE] "
+                  "[--output=JSON]", file=sys.stderr)
+            return EXIT_ERROR
+
+    for name in corpora:
+        if corpusfile is None and name not in CORPORA:
+            print(f"unknown corpus: {name}", file=sys.stderr)
+            return EXIT_ERROR
+    for name in modes:
+        if name not in MODES:
+            print(f"unknown mode: {name}", file=sys.stderr)
+            return EXIT_ERROR
+
+    if not path.isfile(baseCmd):
+        print(f"No executable found at {baseCmd}", file=sys.stderr)
+        return EXIT_ERROR
+
+    shim = path.join(baseDir, MALLOCCOUNT)
+    if not path.isfile(shim):
+        shim = None
+
+    results = []
+    with tempfile.TemporaryDirectory() as tmp:
+        countfile = path.join(tmp, "malloccount.txt")
+        empty = path.join(tmp, "empty.txt")
+        open(empty, "w").close()
+        if corpusfile:
+            with open(corpusfile, "rb") as f:
+                count = sum(1 for line in f if line.strip())
+            files = {path.basename(corpusfile): corpusfile}
+        else:
+            files = {name: writecorpus(name, count, tmp) for name in corpora}
+
+        print(f"{'corpus':<12}{'mode':<12}{'URLs/sec':>12}{'ns/URL':>10}"
+              f"{'allocs/URL':>12}{'peak RSS KB':>13}")
+        for mode in modes:
+            # the startup cost of this mode
+            t0, _, a0 = measure([baseCmd, "-f", empty] + MODES[mode],
+                                runs, shim, countfile)
+            for name, fname in files.items():
+                t, rss, allocs = measure([baseCmd, "-f", fname] + MODES[mode],
+                                         runs, shim, countfile)
+                urls = count
+                if mode == "iterate":
+                    urls *= 3
+                t = max(t - t0, 1e-9)
+                perurl = None
+                if allocs is not None and a0 is not None:
+                    perurl = (allocs - a0) / urls
+                results.append({
+                    "corpus": name,
+                    "mode": mode,
+                    "urls": urls,
+                    "urls_per_sec": urls / t,
+                    "ns_per_url": t * 1e9 / urls,
+                    "allocs_per_url": perurl,
+                    "peak_rss_kb": rss,
+                })
+                shown = "-" if perurl is None else f"{perurl:.1f}"
+                print(f"{name:<12}{mode:<12}{urls / t:>12.0f}"
+                      f"{t * 1e9 / urls:>10.0f}{shown:>12}{rss:>13}")
+
+    if outfile:
+        with open(outfile, "w", encoding="utf-8") as f:
+            json.dump(results, f, indent=2)
+            f.write("\n")
+    return EXIT_SUCCESS
+
+
+if __name__ == "__main__":
+    sys.exit(main(len(sys.argv), sys.argv))
@@ -0,0 +1,81 @@
+#ifndef LIBTRURL_H
+#define LIBTRURL_H
+/***************************************************************************
+ *                                  _   _ ____  _
+ *  Project                     ___| | | |  _ \| |
+ *                             / __| | | | |_) | |
+ *                            | (__| |_| |  _ <| |___
+ *                             \___|\___/|_| \_\_____|
+ *
+ * Copyright (C) Daniel Stenberg, <daniel@haxx.se>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at https://curl.se/docs/copyright.html.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ * SPDX-License-Identifier: curl
+ *
+ ***************************************************************************/
+
+/*
+ * libtrurl runs trurl inside a program. See LIBTRURL.md.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the same values as the trurl exit codes */
+typedef enum {
+  TRURL_OK = 0,
+  TRURL_E_FILE = 1,
+  TRURL_E_APPEND = 2,  /* --append mistake */
+  TRURL_E_ARG = 3,     /* an option misses its argument */
+  TRURL_E_FLAG = 4,    /* an option mistake */
+  TRURL_E_SET = 5,     /* a --set problem */
+  TRURL_E_MEM = 6,     /* out of memory */
+  TRURL_E_URL = 7,     /* could not get a URL out of the set components */
+  TRURL_E_TRIM = 8,    /* a --qtrim problem */
+  TRURL_E_BADURL = 9,  /* if --verify is set and the URL cannot parse */
+  TRURL_E_GET = 10,    /* bad --get syntax */
+  TRURL_E_ITER = 11,   /* bad --iterate syntax */
+  TRURL_E_REPL = 12    /* a --replace problem */
+} trurl_code;
+
+/* Where the output and the notes go. Either callback may be NULL to
+   discard that data. The data is not zero terminated. */
+struct trurl_sink {
+  void (*output)(void *userp, const char *data, size_t len);
+  void (*notes)(void *userp, const char *data, size_t len);
+  void *userp;
+};
+
+struct trurl;
+
+/* Creates a context from trurl command line options, without URLs and
+   without the program name. Problems with the options are sent to the
+   notes of 'sink', which may be NULL. */
+trurl_code trurl_new(struct trurl **tp, int argc, const char **argv,
+                     const struct trurl_sink *sink);
+
+/* Works on the URLs like trurl does with them on the command line. Returns
+   the exit code trurl would return for them. */
+trurl_code trurl_process_batch(struct trurl *t, const char **urls, size_t n,
+                               const struct trurl_sink *sink);
+
+void trurl_free(struct trurl *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBTRURL_H */
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+##########################################################################
+#                                  _   _ ____  _
+#  Project                     ___| | | |  _ \| |
+#                             / __| | | | |_) | |
+#                            | (__| |_| |  _ <| |___
+#                             \___|\___/|_| \_\_____|
+#
+# Copyright (C) Daniel Stenberg, <daniel@haxx.se>, et al.
+#
+# This software is licensed as described in the file COPYING, which
+# you should have received as part of this distribution. The terms
+# are also available at https://curl.se/docs/copyright.html.
+#
+# You may opt to use, copy, modify, merge, publish, distribute and/or sell
+# copies of the Software, and permit persons to whom the Software is
+# furnished to do so, under the terms of the COPYING file.
+#
+# This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+# KIND, either express or implied.
+#
+# SPDX-License-Identifier: curl
+#
+##########################################################################
+
+# Reads trurl --columnar output from stdin and writes it as JSON Lines,
+# like --jsonl does. Serves as the reference reader for the format.
+#
+#   trurl --columnar -f urls.txt | scripts/columnar.py
+
+import sys
+import json
+import struct
+
+
+def u32(data, pos):
+    return struct.unpack_from("<I", data, pos)[0], pos + 4
+
+
+# one string column: validity bitmap, n + 1 offsets, data
+def column(data, pos, n):
+    valid = data[pos:pos + (n + 7) // 8]
+    pos += (n + 7) // 8
+    offsets = struct.unpack_from(f"<{n + 1}I", data, pos)
+    pos += 4 * (n + 1)
+    base = pos
+    values = []
+    for i in range(n):
+        if valid[i >> 3] & (1 << (i & 7)):
+            values.append(data[base + offsets[i]:base + offsets[i + 1]]
+                          .decode("utf-8", "replace"))
+        else:
+            values.append(None)
+    return values, base + offsets[n]
+
+
+def main():
+    data = sys.stdin.buffer.read()
+    if data[:8] != b"TRURLCOL":
+        print("not trurl columnar data", file=sys.stderr)
+        return 1
+    pos = 8
+    version, pos = u32(data, pos)
+    if version != 1:
+        print(f"unsupported version {version}", file=sys.stderr)
+        return 1
+    ncols, pos = u32(data, pos)
+    names = []
+    for _ in range(ncols):
+        n, pos = u32(data, pos)
+        names.append(data[pos:pos + n].decode())
+        pos += n
+    out = sys.stdout
+    while True:
+        rows, pos = u32(data, pos)
+        if not rows:
+            break
+        npairs, pos = u32(data, pos)
+        cols = []
+        for _ in range(ncols - 2):
+            values, pos = column(data, pos, rows)
+            cols.append(values)
+        params = struct.unpack_from(f"<{rows + 1}I", data, pos)
+        pos += 4 * (rows + 1)
+        keys, pos = column(data, pos, npairs)
+        values, pos = column(data, pos, npairs)
+        for r in range(rows):
+            obj = {"url": cols[0][r], "parts": {}}
+            for c in range(1, ncols - 2):
+                if cols[c][r] is not None:
+                    obj["parts"][names[c]] = cols[c][r]
+            pairs = range(params[r], params[r + 1])
+            if len(pairs):
+                obj["params"] = [{"key": keys[p], "value": values[p] or ""}
+                                 for p in pairs]
+            out.write(json.dumps(obj, ensure_ascii=False,
+                                 separators=(",", ":")) + "\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,231 @@
+/***************************************************************************
+ *                                  _   _ ____  _
+ *  Project                     ___| | | |  _ \| |
+ *                             / __| | | | |_) | |
+ *                            | (__| |_| |  _ <| |___
+ *                             \___|\___/|_| \_\_____|
+ *
+ * Copyright (C) Daniel Stenberg, <daniel@haxx.se>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at https://curl.se/docs/copyright.html.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ * SPDX-License-Identifier: curl
+ *
+ ***************************************************************************/
+
+/*
+ * Tests the libtrurl API. 'make lib' builds it and test.py runs it. Exits
+ * with 1 if a test fails.
+ *
+ * TRURL_E_FILE, TRURL_E_MEM and TRURL_E_REPL cannot be made to happen
+ * through the API: the options reading files are command line only and
+ * --replace without data is a missing argument.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libtrurl.h"
+
+struct collect {
+  char data[1024];
+  size_t len;
+};
+
+struct sinkdata {
+  struct collect out;
+  struct collect notes;
+};
+
+struct libcase {
+  const char *args[5]; /* NULL terminated */
+  const char *urls[3]; /* NULL terminated, none makes a URL from --set */
+  trurl_code newrc;    /* of trurl_new() */
+  trurl_code rc;       /* of trurl_process_batch() */
+  const char *output;
+  const char *notes;   /* found in the notes, "" for no notes */
+};
+
+static struct libcase cases[] = {
+  /* output through the sink */
+  {{"--get", "{host}", NULL}, {"https://example.com/x", "curl.se", NULL},
+   TRURL_OK, TRURL_OK, "example.com\ncurl.se\n", ""},
+  {{"--set", "host=example.com", "--set", "scheme=https"}, {NULL},
+   TRURL_OK, TRURL_OK, "https://example.com/\n", ""},
+  /* notes */
+  {{"--get", "{host}", NULL}, {"htt p://x", NULL},
+   TRURL_OK, TRURL_OK, "", "trurl note: Port number was not"},
+  {{"--set", "port=99999", NULL}, {"x.org", NULL},
+   TRURL_OK, TRURL_OK, "http://x.org/\n", "trurl note: Error setting port"},
+  /* errors of trurl_new() */
+  {{"--append", "bogus=1", NULL}, {NULL},
+   TRURL_E_APPEND, TRURL_OK, "", "--append unsupported component"},
+  {{"--get", NULL}, {NULL},
+   TRURL_E_ARG, TRURL_OK, "", "Missing argument for --get"},
+  {{"--bogus", NULL}, {NULL},
+   TRURL_E_FLAG, TRURL_OK, "", "unknown option: --bogus"},
+  {{"--trim", "bogus=x", NULL}, {NULL},
+   TRURL_E_TRIM, TRURL_OK, "", "Unsupported trim component"},
+  {{"--get", "{bogus}", NULL}, {NULL},
+   TRURL_E_GET, TRURL_OK, "", "\"bogus\" is not a recognized URL component"},
+  {{"--iterate", "bogus", NULL}, {NULL},
+   TRURL_E_ITER, TRURL_OK, "", "wrong iterate syntax"},
+  /* errors of trurl_process_batch() */
+  {{"--set", "bogus", NULL}, {"x.org", NULL},
+   TRURL_OK, TRURL_E_SET, "", "invalid --set syntax"},
+  {{"--verify", NULL}, {NULL},
+   TRURL_OK, TRURL_E_URL, "", "not enough input for a URL"},
+  {{"--verify", NULL}, {"htt p://x", NULL},
+   TRURL_OK, TRURL_E_BADURL, "", "trurl error: Port number was not"},
+  {{"--get", "{:must:port}", NULL}, {"x.org", NULL},
+   TRURL_OK, TRURL_E_GET, "", "missing must:port"},
+  /* command line only */
+  {{"-f", "urls.txt", NULL}, {NULL},
+   TRURL_E_FLAG, TRURL_OK, "", "-f is only supported on the command line"},
+  {{"--url-file=urls.txt", NULL}, {NULL},
+   TRURL_E_FLAG, TRURL_OK, "", "--url-file is only supported"},
+  {{"--filter-host", "/etc/passwd", NULL}, {NULL},
+   TRURL_E_FLAG, TRURL_OK, "", "--filter-host is only supported"},
+  {{"--parallel", "2", NULL}, {NULL},
+   TRURL_E_FLAG, TRURL_OK, "", "--parallel is only supported"},
+  {{"--serve", NULL}, {NULL},
+   TRURL_E_FLAG, TRURL_OK, "", "--serve is only supported"},
+  {{"--stats", NULL}, {NULL},
+   TRURL_E_FLAG, TRURL_OK, "", "--stats is only supported"},
+  {{"--help", NULL}, {NULL},
+   TRURL_E_FLAG, TRURL_OK, "", "--help is only supported"},
+  {{"example.com", NULL}, {NULL},
+   TRURL_E_FLAG, TRURL_OK, "", "the URLs are passed to trurl_process_batch()"},
+};
+
+static void add(struct collect *c, const char *data, size_t len)
+{
+  if(len > sizeof(c->data) - 1 - c->len)
+    len = sizeof(c->data) - 1 - c->len;
+  memcpy(&c->data[c->len], data, len);
+  c->len += len;
+  c->data[c->len] = 0;
+}
+
+static void sinkoutput(void *userp, const char *data, size_t len)
+{
+  add(&((struct sinkdata *)userp)->out, data, len);
+}
+
+static void sinknotes(void *userp, const char *data, size_t len)
+{
+  add(&((struct sinkdata *)userp)->notes, data, len);
+}
+
+static size_t count(const char **list)
+{
+  size_t n = 0;
+  while(list[n])
+    n++;
+  return n;
+}
+
+/* Returns the number of problems found */
+static int check(const char *name, trurl_code rc, trurl_code exp,
+                 const struct sinkdata *d, const char *output,
+                 const char *notes)
+{
+  int fails = 0;
+  if(rc != exp) {
+    printf("%s: returned %d, expected %d\n", name, (int)rc, (int)exp);
+    fails++;
+  }
+  if(strcmp(d->out.data, output)) {
+    printf("%s: output \"%s\", expected \"%s\"\n", name, d->out.data, output);
+    fails++;
+  }
+  if(*notes ? !strstr(d->notes.data, notes) : !!d->notes.len) {
+    printf("%s: notes \"%s\", expected \"%s\"\n", name, d->notes.data,
+           notes);
+    fails++;
+  }
+  return fails;
+}
+
+static int runcase(struct libcase *c, size_t num)
+{
+  struct sinkdata d;
+  struct trurl_sink sink = { sinkoutput, sinknotes, NULL };
+  struct trurl *t;
+  trurl_code rc;
+  int fails;
+  const char *name = c->args[0];
+  memset(&d, 0, sizeof(d));
+  sink.userp = &d;
+
+  rc = trurl_new(&t, (int)count(c->args), c->args, &sink);
+  if(rc || c->newrc)
+    fails = check(name, rc, c->newrc, &d, "", c->notes);
+  else {
+    fails = check(name, rc, TRURL_OK, &d, "", "");
+    if(!fails) {
+      rc = trurl_process_batch(t, c->urls, count(c->urls), &sink);
+      fails = check(name, rc, c->rc, &d, c->output, c->notes);
+    }
+  }
+  trurl_free(t); /* NULL if trurl_new() failed */
+  if(fails)
+    printf("  in case %u\n", (unsigned int)num);
+  return fails;
+}
+
+/* a handle keeps working after a batch with an error, and without a sink */
+static int reuse(void)
+{
+  static const char *args[] = { "--verify", "--get", "{host}" };
+  static const char *bad[] = { "htt p://x", "a.org" };
+  static const char *good[] = { "b.org" };
+  struct sinkdata d;
+  struct trurl_sink sink = { sinkoutput, sinknotes, NULL };
+  struct trurl *t;
+  int fails;
+  memset(&d, 0, sizeof(d));
+  sink.userp = &d;
+
+  if(trurl_new(&t, 3, args, NULL)) {
+    printf("reuse: trurl_new() failed\n");
+    return 1;
+  }
+  fails = check("reuse", trurl_process_batch(t, bad, 2, &sink),
+                TRURL_E_BADURL, &d, "", "trurl error: Port number");
+  memset(&d, 0, sizeof(d));
+  fails += check("reuse", trurl_process_batch(t, good, 1, &sink),
+                 TRURL_OK, &d, "b.org\n", "");
+  fails += check("reuse", trurl_process_batch(t, bad, 2, NULL),
+                 TRURL_E_BADURL, &d, "b.org\n", "");
+  memset(&d, 0, sizeof(d));
+  fails += check("reuse", trurl_process_batch(t, good, 1, &sink),
+                 TRURL_OK, &d, "b.org\n", "");
+  trurl_free(t);
+  return fails;
+}
+
+int main(void)
+{
+  size_t i;
+  int fails = 0;
+  for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    fails += runcase(&cases[i], i + 1);
+  fails += reuse();
+  if(fails) {
+    printf("libtest: %d problems\n", fails);
+    return 1;
+  }
+  printf("libtest: %u tests passed\n",
+         (unsigned int)(sizeof(cases) / sizeof(cases[0]) + 1));
+  return 0;
+}
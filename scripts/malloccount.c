@@ -0,0 +1,83 @@
+/***************************************************************************
+ *                                  _   _ ____  _
+ *  Project                     ___| | | |  _ \| |
+ *                             / __| | | | |_) | |
+ *                            | (__| |_| |  _ <| |___
+ *                             \___|\___/|_| \_\_____|
+ *
+ * Copyright (C) Daniel Stenberg, <daniel@haxx.se>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at https://curl.se/docs/copyright.html.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ * SPDX-License-Identifier: curl
+ *
+ ***************************************************************************/
+
+/*
+ * LD_PRELOAD library that counts the memory allocations of a process, for
+ * the benchmarks. glibc only. When the process exits, the number of
+ * allocations and the number of bytes asked for are written to the file
+ * named in the MALLOCCOUNT environment variable:
+ *
+ *   allocs: [number]
+ *   bytes: [number]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+static unsigned long long bytes;
+
+static void count(size_t size)
+{
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+  count(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  count(nmemb * size);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  count(size);
+  return __libc_realloc(ptr, size);
+}
+
+__attribute__((destructor))
+static void report(void)
+{
+  /* read the counters before fopen() allocates */
+  unsigned long a = allocs;
+  unsigned long long b = bytes;
+  const char *name = getenv("MALLOCCOUNT");
+  if(name) {
+    FILE *f = fopen(name, "w");
+    if(f) {
+      fprintf(f, "allocs: %lu\nbytes: %llu\n", a, b);
+      fclose(f);
+    }
+  }
+}
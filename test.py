@@ -27,7 +27,7 @@ import sys
 from os import getcwd, path
 import json
 import shlex
-from subprocess import PIPE, run, Popen
+from subprocess import DEVNULL, PIPE, run, Popen
 from dataclasses import dataclass, asdict
 from typing import Any, Optional, TextIO
 import locale
@@ -37,6 +37,14 @@ TESTFILE = "tests.json"
 VALGRINDTEST = "valgrind"
 VALGRINDARGS = ["--error-exitcode=1", "--leak-check=full", "-q"]
 
+# --perf, the tests with a "perf" object run on a generated corpus
+MALLOCCOUNT = "scripts/malloccount.so"
+LIBTEST = "scripts/libtest"  # built by make lib
+PERFCOUNT = 20000
+PERFRUNS = 3
+PERFTOLERANCE = 0.25  # throughput loss allowed against the baseline
+ALLOCSLACK = 0.05     # allocations per URL allowed above the baseline
+
 RED = "\033[91m"  # used to mark unsuccessful tests
 NOCOLOR = "\033[0m"
 
@@ -51,6 +59,10 @@ class CommandOutput:
 
 
 def testComponent(value, exp):
+    if isinstance(exp, dict):
+        # {"contains": [...]}, for output that is not the same every time
+        return isinstance(value, str) and \
+            all(part in value for part in exp["contains"])
     if isinstance(exp, bool):
         result = value == 0 or value not in ("", [])
         if exp:
@@ -82,6 +94,7 @@ class TestCase:
         self.runnerCmd = runnerCmd
         self.baseCmd = baseCmd
         self.arguments = testCase["input"]["arguments"]
+        self.stdin = testCase["input"].get("stdin")
         self.expected = testCase["expected"]
         self.commandOutput: CommandOutput = None
         self.testPassed: bool = False
@@ -102,6 +115,7 @@ class TestCase:
 
         output = run(
             cmd + args,
+            input=self.stdin,
             stdout=PIPE, stderr=PIPE,
             encoding="utf-8"
         )
@@ -176,6 +190,163 @@ class TestCase:
             self._printConcise(output)
 
 
+# the URL file of a perf test is replaced with the corpus
+def perfArguments(arguments, fname):
+    args = list(arguments)
+    for i, arg in enumerate(args[:-1]):
+        if arg in ("-f", "--url-file"):
+            args[i + 1] = fname
+            return args
+    return None
+
+
+# baselines are found by the arguments, with the corpus as the URL file,
+# not by the test number
+def perfKey(arguments):
+    return shlex.join(arguments)
+
+
+def perfCheck(perf, result, baseline, tolerance):
+    problems = []
+    speed = result["urls_per_sec"]
+    allocs = result["allocs_per_url"]
+    budget = perf.get("urls_per_sec")
+    if budget and speed < budget:
+        problems.append(f"{speed:.0f} URLs/sec is below the budget {budget}")
+    budget = perf.get("allocs_per_url")
+    if budget is not None and allocs is not None and allocs > budget:
+        problems.append(f"{allocs:.2f} allocs/URL is above the budget {budget}")
+    if baseline:
+        old = baseline["urls_per_sec"]
+        if speed < old * (1 - tolerance):
+            problems.append(f"{speed:.0f} URLs/sec is {100 * (1 - speed / old):.0f}% "
+                            f"slower than the baseline {old:.0f}")
+        old = baseline.get("allocs_per_url")
+        if allocs is not None and old is not None and allocs > old + ALLOCSLACK:
+            problems.append(f"{allocs:.2f} allocs/URL is more than the baseline "
+                            f"{old:.2f}")
+    return problems
+
+
+# the performance mode, runs the tests that have a "perf" object
+def perfTests(allTests, testIndexesToRun, baseCmd, baseDir, features, opts):
+    import tempfile
+    import bench
+
+    shim = path.join(baseDir, MALLOCCOUNT)
+    if not path.isfile(shim):
+        print(f"No {MALLOCCOUNT}, allocations are not checked "
+              f"(make {MALLOCCOUNT})")
+        shim = None
+
+    baseline = {}
+    if opts["baseline"]:
+        if not path.isfile(opts["baseline"]):
+            return f" error: no baseline {opts['baseline']}"
+        with open(opts["baseline"], "r", encoding="utf-8") as file:
+            baseline = json.load(file).get("tests")
+        if not baseline:
+            return f" error: the baseline {opts['baseline']} has no tests"
+
+    results = {}
+    numFailed = 0
+    numPassed = 0
+    numSkipped = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        countfile = path.join(tmp, "malloccount.txt")
+        empty = path.join(tmp, "empty.txt")
+        open(empty, "w").close()
+        corpora = {}
+        for testIndex in testIndexesToRun:
+            test = allTests[testIndex]
+            perf = test.get("perf")
+            if not perf:
+                continue
+            required = test.get("required", None)
+            if required and not set(required).issubset(set(features)):
+                print(f"Missing feature, skipping test {testIndex + 1}.")
+                numSkipped += 1
+                continue
+            corpus = perf.get("corpus", "short")
+            if corpus not in bench.CORPORA:
+                return f" error: test {testIndex + 1} has an unknown corpus {corpus}"
+            arguments = test["input"]["arguments"]
+            args = perfArguments(arguments, empty)
+            if args is None:
+                return f" error: test {testIndex + 1} does not read an --url-file"
+            if corpus not in corpora:
+                corpora[corpus] = bench.writecorpus(corpus, opts["count"], tmp)
+
+            # a trurl that exits with an error is fast but measures nothing
+            corpusArgs = perfArguments(arguments, corpora[corpus])
+            exitcode = run([baseCmd] + corpusArgs, stdout=DEVNULL,
+                           stderr=DEVNULL).returncode
+            if exitcode != test["expected"].get("returncode", 0):
+                text = (f"{testIndex + 1}: {baseCmd} cannot run the test, "
+                        f"exit code {exitcode}")
+                if opts["update"]:
+                    # an older trurl may lack the options of a new test
+                    print(f"{text}, skipped")
+                    numSkipped += 1
+                else:
+                    print(f"{RED}{text}{NOCOLOR}", file=sys.stderr)
+                    numFailed += 1
+                continue
+
+            # the startup cost is subtracted, like bench.py does
+            t0, _, a0 = bench.measure([baseCmd] + args, opts["runs"],
+                                      shim, countfile)
+            t, _, allocs = bench.measure([baseCmd] + corpusArgs, opts["runs"],
+                                         shim, countfile)
+            t = max(t - t0, 1e-9)
+            result = {
+                "urls_per_sec": opts["count"] / t,
+                "allocs_per_url": None if allocs is None or a0 is None
+                else (allocs - a0) / opts["count"],
+            }
+            key = perfKey(perfArguments(arguments, f"{corpus}.txt"))
+            results[key] = result
+
+            problems = []
+            if not opts["update"]:
+                problems = perfCheck(perf, result, baseline.get(key),
+                                     opts["tolerance"])
+            shown = "-" if result["allocs_per_url"] is None \
+                else f"{result['allocs_per_url']:.2f}"
+            text = (f"{testIndex + 1}: {'failed' if problems else 'passed'}\t"
+                    f"{key}: {result['urls_per_sec']:.0f} URLs/sec, "
+                    f"{shown} allocs/URL")
+            if problems:
+                print(f"{RED}{text}{NOCOLOR}", file=sys.stderr)
+                for problem in problems:
+                    print(f"  {problem}", file=sys.stderr)
+                numFailed += 1
+            else:
+                print(text)
+                numPassed += 1
+
+    if opts["update"]:
+        if not results:
+            return f" error: {baseCmd} ran no test, {opts['update']} not written"
+        version = run([baseCmd, "--version"], stdout=PIPE,
+                      encoding="utf-8").stdout.split("\n")[0]
+        with open(opts["update"], "w", encoding="utf-8") as file:
+            json.dump({"trurl": version, "count": opts["count"],
+                       "tests": results}, file, indent=2)
+            file.write("\n")
+
+    print("Finished:")
+    result = ", ".join([
+        f"Failed: {numFailed}",
+        f"Passed: {numPassed}",
+        f"Skipped: {numSkipped}"
+    ])
+    if numFailed == 0:
+        print("Passed! - ", result)
+        return EXIT_SUCCESS
+    return f"Failed! - {result}"
+
+
 def main(argc, argv):
     ret = EXIT_SUCCESS
     baseDir = path.dirname(path.realpath(argv[0]))
@@ -200,6 +371,14 @@ def main(argc, argv):
     runWithValgrind = False
     verboseDetail = False
     runnerCmd = ""
+    perfMode = False
+    perfOpts = {
+        "count": PERFCOUNT,
+        "runs": PERFRUNS,
+        "tolerance": PERFTOLERANCE,
+        "baseline": None,
+        "update": None,
+    }
 
     if argc > 1:
         for arg in argv[1:]:
@@ -217,9 +396,28 @@ def main(argc, argv):
                 baseCmd = arg[len("--trurl="):]
             elif arg.startswith("--runner="):
                 runnerCmd = arg[len("--runner="):]
+            elif arg == "--perf":
+                perfMode = True
+            elif arg.startswith("--perf-count="):
+                perfOpts["count"] = int(arg[len("--perf-count="):])
+            elif arg.startswith("--perf-runs="):
+                perfOpts["runs"] = int(arg[len("--perf-runs="):])
+            elif arg.startswith("--perf-tolerance="):
+                perfOpts["tolerance"] = float(arg[len("--perf-tolerance="):])
+            elif arg.startswith("--perf-baseline="):
+                perfMode = True
+                perfOpts["baseline"] = arg[len("--perf-baseline="):]
+            elif arg.startswith("--perf-update="):
+                perfMode = True
+                perfOpts["update"] = arg[len("--perf-update="):]
             else:
                 cmdfilter = argv[1]
 
+    if perfMode and (runWithValgrind or runnerCmd != ""):
+        print("Error: --perf does not work with --with-valgrind or --runner",
+              file=sys.stderr)
+        return EXIT_ERROR
+
     if runWithValgrind and not check_valgrind():
         print(f'Error: {VALGRINDTEST} is not installed!', file=sys.stderr)
         return EXIT_ERROR
@@ -240,6 +438,10 @@ def main(argc, argv):
         )
         features = output.stdout.split('\n')[1].split()[1:]
 
+        if perfMode:
+            return perfTests(allTests, testIndexesToRun, baseCmd, baseDir,
+                             features, perfOpts)
+
         numTestsFailed = 0
         numTestsPassed = 0
         numTestsSkipped = 0
@@ -272,13 +474,28 @@ def main(argc, argv):
                     test.printDetail(verbose=True, failed=True)
                     numTestsFailed += 1
 
+        numTests = len(testIndexesToRun)
+        libtest = path.join(baseDir, LIBTEST)
+        if testIndexesToRun == list(range(len(allTests))) and \
+           cmdfilter == "" and runnerCmd == "" and path.isfile(libtest):
+            numTests += 1
+            output = run([libtest], stdout=PIPE, stderr=PIPE,
+                         encoding="utf-8")
+            if output.returncode == 0:
+                print(f"{LIBTEST}: passed")
+                numTestsPassed += 1
+            else:
+                print(f"{RED}{LIBTEST}: failed{NOCOLOR}", file=sys.stderr)
+                print(output.stdout + output.stderr, file=sys.stderr)
+                numTestsFailed += 1
+
         # finally print the results to terminal
         print("Finished:")
         result = ", ".join([
             f"Failed: {numTestsFailed}",
             f"Passed: {numTestsPassed}",
             f"Skipped: {numTestsSkipped}",
-            f"Total: {len(testIndexesToRun)}"
+            f"Total: {numTests}"
         ])
         if (numTestsFailed == 0):
             print("Passed! - ", result)
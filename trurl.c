@@ -42,8 +42,41 @@ typedef enum {
 #endif
 
 #include <locale.h> /* for setlocale() */
+#include <time.h>
+#ifdef _WIN32
+#include <io.h> /* for _setmode() */
+#include <fcntl.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h> /* for read() */
+#include <signal.h>
+#include <sys/socket.h> /* for --serve-socket */
+#include <sys/un.h>
+#endif
+#include <setjmp.h>
+
+#if !defined(_WIN32) && !defined(TRURL_NO_THREADS) && \
+  !defined(TRURL_LIBRARY)
+#define USE_THREADS
+#include <pthread.h>
+#endif
+
+/* compressed --url-file input and output, 'make TRURL_ZLIB=1 TRURL_ZSTD=1' */
+#if (defined(HAVE_ZLIB) || defined(HAVE_ZSTD)) && !defined(TRURL_LIBRARY)
+#define USE_COMPRESSION
+#ifdef HAVE_ZLIB
+#define ZLIB_CONST
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#endif
 
 #include "version.h"
+#ifdef TRURL_LIBRARY
+#include "libtrurl.h"
+#endif
 
 #ifdef _MSC_VER
 #define strdup _strdup
@@ -181,7 +214,7 @@ static const unsigned char touppermap[256] = {
 
 /* Portable, ASCII-consistent toupper. Do not use toupper() because its
    behavior is altered by the current locale. */
-#define raw_toupper(in) touppermap[(unsigned int)in]
+#define raw_toupper(in) touppermap[(unsigned char)(in)]
 
 /*
  * casecompare() does ASCII based case insensitive checks, as a strncasecmp
@@ -205,27 +238,547 @@ static int casecompare(const char *first, const char *second, size_t max)
   return raw_toupper(*first) - raw_toupper(*second);
 }
 
-static void message_low(const char *prefix, const char *suffix,
-                        const char *fmt, va_list ap)
+/* the unusual thing here is that we let '*' remain as-is */
+#define ISURLPUNTCS(x) (((x) == '-') || ((x) == '.') || ((x) == '_') || \
+                        ((x) == '~') || ((x) == '*'))
+#define ISUPPER(x)  (((x) >= 'A') && ((x) <= 'Z'))
+#define ISLOWER(x)  (((x) >= 'a') && ((x) <= 'z'))
+#define ISDIGIT(x)  (((x) >= '0') && ((x) <= '9'))
+#define ISALNUM(x)  (ISDIGIT(x) || ISLOWER(x) || ISUPPER(x))
+#define ISUNRESERVED(x) (ISALNUM(x) || ISURLPUNTCS(x))
+#define ISXDIGIT(x) (ISDIGIT(x) || \
+                     (((x) >= 'a') && ((x) <= 'f')) || \
+                     (((x) >= 'A') && ((x) <= 'F')))
+#define HEXVAL(x) (ISDIGIT(x) ? ((x) - '0') : ((raw_toupper(x) - 'A') + 10))
+
+/* URL decode into 'out', which needs room for 'len' bytes. With 'plus' set,
+   a '+' is decoded into a space as in queries. Returns the number of bytes
+   written. */
+static size_t urldecode(char *out, const char *in, size_t len, bool plus)
+{
+  char *p = out;
+  while(len) {
+    if((*in == '%') && (len > 2) && ISXDIGIT(in[1]) && ISXDIGIT(in[2])) {
+      *p++ = (char)((HEXVAL(in[1]) << 4) | HEXVAL(in[2]));
+      in += 3;
+      len -= 3;
+    }
+    else {
+      *p++ = (plus && (*in == '+')) ? ' ' : *in;
+      in++;
+      len--;
+    }
+  }
+  return p - out;
+}
+
+/* URL decode query data and encode it back again into 'out', which needs
+   room for three times 'len' bytes. Returns the number of bytes written.
+
+   To handle ' ' to '+' escaping we cannot use libcurl's URL encode
+   function. */
+static size_t normquery(char *out, const char *in, size_t len)
+{
+  const char hex[] = "0123456789abcdef";
+  char *p = out;
+  while(len) {
+    /* treat the characters unsigned */
+    unsigned char c = (unsigned char)*in;
+    if((c == '%') && (len > 2) && ISXDIGIT(in[1]) && ISXDIGIT(in[2])) {
+      c = (unsigned char)((HEXVAL(in[1]) << 4) | HEXVAL(in[2]));
+      in += 3;
+      len -= 3;
+    }
+    else {
+      if(c == '+')
+        c = ' ';
+      in++;
+      len--;
+    }
+
+    if(c == ' ')
+      *p++ = '+';
+    else if(ISUNRESERVED(c))
+      *p++ = (char)c;
+    else {
+      /* encode it */
+      p[0] = '%';
+      p[1] = hex[c >> 4];
+      p[2] = hex[c & 0xf];
+      p += 3;
+    }
+  }
+  return p - out;
+}
+
+/* the bytes libcurl's curl_easy_escape() does not encode */
+static const unsigned char urlsafe[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x00 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x10 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, /* 0x20 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, /* 0x30 */
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 0x40 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, /* 0x50 */
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 0x60 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0 /* 0x70 */
+};
+
+#define ISUPHEX(x) (ISDIGIT(x) || (((x) >= 'A') && ((x) <= 'F')))
+
+/* Returns true if URL decoding and then encoding the data again the way
+   libcurl does it would not change it, so that can be skipped. The 'keep'
+   byte is accepted as-is when not encoded. */
+static bool urlcanonical(const char *in, size_t len, char keep)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  const unsigned char *end = p + len;
+  while(p < end) {
+    if(urlsafe[*p] || (keep && (*p == (unsigned char)keep)))
+      p++;
+    else if((*p == '%') && ((end - p) > 2) && ISUPHEX(p[1]) &&
+            ISUPHEX(p[2]) && !urlsafe[(HEXVAL(p[1]) << 4) | HEXVAL(p[2])])
+      /* upper case encoding of a byte that needs it */
+      p += 3;
+    else
+      return false;
+  }
+  return true;
+}
+
+/* URL decode and then encode the data again the way libcurl does it, into
+   'out' that needs room for three times 'len' bytes. The 'keep' byte is
+   left as-is when not encoded. Returns the number of bytes written. */
+static size_t urlnormalize(char *out, const char *in, size_t len, char keep)
 {
-  fputs(prefix, stderr);
-  vfprintf(stderr, fmt, ap);
-  fputs(suffix, stderr);
+  const char hex[] = "0123456789ABCDEF";
+  char *p = out;
+  while(len) {
+    unsigned char c = (unsigned char)*in;
+    if((c == '%') && (len > 2) && ISXDIGIT(in[1]) && ISXDIGIT(in[2])) {
+      c = (unsigned char)((HEXVAL(in[1]) << 4) | HEXVAL(in[2]));
+      in += 3;
+      len -= 3;
+    }
+    else {
+      in++;
+      len--;
+      if(keep && (c == (unsigned char)keep)) {
+        *p++ = (char)c;
+        continue;
+      }
+    }
+    if(urlsafe[c])
+      *p++ = (char)c;
+    else {
+      p[0] = '%';
+      p[1] = hex[c >> 4];
+      p[2] = hex[c & 0xf];
+      p += 3;
+    }
+  }
+  return p - out;
 }
 
-static void warnf_low(const char *fmt, va_list ap)
+#define KEYHASH_MIN 16 /* smallest number of hash buckets */
+
+/* Chained hash table from key hashes to entry numbers. The entries with
+   their keys are stored by the user, lookups return the candidates with a
+   matching hash in the order they were added. */
+struct keyhash {
+  int *slot;          /* first entry per bucket, -1 when empty */
+  int *tail;          /* last entry per bucket */
+  int *next;          /* next entry in the same bucket */
+  unsigned int *hash; /* hash per entry */
+  unsigned int mask;  /* number of buckets - 1 */
+  int alloc;          /* number of entries there is room for */
+};
+
+/* FNV-1a, optionally ASCII case insensitive */
+static unsigned int hashkey(const char *key, size_t len, bool nocase)
 {
-  message_low(WARN_PREFIX, "\n", fmt, ap);
+  unsigned int h = 2166136261U;
+  size_t i;
+  for(i = 0; i < len; i++) {
+    h ^= nocase ? (unsigned char)raw_toupper(key[i]) : (unsigned char)key[i];
+    h *= 16777619U;
+  }
+  return h;
 }
 
-static void warnf(const char *fmt, ...)
+/* clear the table and make it suitable for 'entries' entries */
+static bool keyhash_reset(struct keyhash *h, int entries)
 {
-  va_list ap;
-  va_start(ap, fmt);
-  warnf_low(fmt, ap);
-  va_end(ap);
+  unsigned int buckets = KEYHASH_MIN;
+  unsigned int i;
+  while(buckets < (unsigned int)entries * 2)
+    buckets *= 2;
+  if(buckets > h->mask + 1 || !h->slot) {
+    int *slot = realloc(h->slot, buckets * sizeof(int));
+    int *tail;
+    if(!slot)
+      return false;
+    h->slot = slot;
+    tail = realloc(h->tail, buckets * sizeof(int));
+    if(!tail)
+      return false;
+    h->tail = tail;
+    h->mask = buckets - 1;
+  }
+  for(i = 0; i <= h->mask; i++)
+    h->slot[i] = -1;
+  return true;
+}
+
+static bool keyhash_add(struct keyhash *h, int entry, unsigned int hash)
+{
+  unsigned int b = hash & h->mask;
+  if(entry >= h->alloc) {
+    int alloc = h->alloc ? h->alloc * 2 : KEYHASH_MIN;
+    int *next;
+    unsigned int *hashes;
+    while(entry >= alloc)
+      alloc *= 2;
+    next = realloc(h->next, alloc * sizeof(int));
+    if(!next)
+      return false;
+    h->next = next;
+    hashes = realloc(h->hash, alloc * sizeof(unsigned int));
+    if(!hashes)
+      return false;
+    h->hash = hashes;
+    h->alloc = alloc;
+  }
+  h->next[entry] = -1;
+  h->hash[entry] = hash;
+  if(h->slot[b] < 0)
+    h->slot[b] = entry;
+  else
+    h->next[h->tail[b]] = entry;
+  h->tail[b] = entry;
+  return true;
+}
+
+/* the entry after 'entry' with the same hash, or -1 */
+static int keyhash_next(const struct keyhash *h, int entry)
+{
+  unsigned int hash = h->hash[entry];
+  do
+    entry = h->next[entry];
+  while((entry >= 0) && (h->hash[entry] != hash));
+  return entry;
+}
+
+/* the first entry with this hash, or -1 */
+static int keyhash_first(const struct keyhash *h, unsigned int hash)
+{
+  int entry = h->slot[hash & h->mask];
+  while((entry >= 0) && (h->hash[entry] != hash))
+    entry = h->next[entry];
+  return entry;
+}
+
+static void keyhash_free(struct keyhash *h)
+{
+  free(h->slot);
+  free(h->tail);
+  free(h->next);
+  free(h->hash);
+  memset(h, 0, sizeof(*h));
+}
+
+/* The outputs seen with --unique, as 64-bit fingerprints in an open
+   addressing table. With --unique-exact, the outputs are also kept to tell
+   apart different ones with the same fingerprint. */
+struct urlset {
+  uint64_t *fp;  /* zero when unused */
+  size_t *text;  /* --unique-exact: where the output is in 'texts' */
+  char *texts;
+  size_t tlen;
+  size_t tsize;
+  size_t mask;   /* number of slots - 1 */
+  size_t count;  /* slots in use */
+};
+
+/* an output of a --parallel job, with --unique */
+struct record {
+  size_t len;
+  uint64_t fp;
+};
+
+struct countentry {
+  uint64_t hash;
+  uint64_t count; /* zero when unused */
+  size_t key;     /* where the key is in 'keys' */
+  size_t len;
+};
+
+/* --compress-output and compressed --url-file data */
+enum packtype {
+  PACK_NONE,
+  PACK_GZIP,
+  PACK_ZSTD
+};
+
+#ifdef USE_COMPRESSION
+#define PACK_BLOCK 65536 /* compressed data is read and written in these */
+
+enum packflush {
+  PACK_DATA,  /* more data follows */
+  PACK_FLUSH, /* everything so far must be possible to decompress */
+  PACK_FINISH /* the end of the stream */
+};
+
+/* compresses the data written to an output stream */
+struct packer {
+  enum packtype type;
+  FILE *stream;
+  unsigned char *buf;
+  bool pending; /* data was compressed since the last flush */
+  bool failed;
+#ifdef HAVE_ZLIB
+  z_stream zs;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_CStream *zc;
+#endif
+};
+#endif
+
+#define OUTBUF_SIZE 65536 /* output buffer size */
+
+/* Output is collected in a buffer to avoid a write per URL. With a stream
+   or a sink set, the buffer is flushed when full. Without either, the
+   buffer grows to keep all data in memory. */
+struct outbuf {
+  char *buf;
+  size_t len;  /* used */
+  size_t size; /* allocated */
+  FILE *stream; /* flush destination */
+  struct packer *pack; /* compresses what goes to 'stream' */
+  void (*sink)(void *userp, const char *data, size_t len); /* or this */
+  void *userp;
+  size_t mark; /* with 'held' set, the data from here is kept */
+  bool held;
+  bool oom; /* growing the buffer failed, data was lost */
+};
+
+/* --count and --count-keys, the number of times each key was seen */
+struct counter {
+  struct countentry *e; /* open addressing */
+  size_t mask;          /* number of slots - 1 */
+  size_t used;
+  char *keys;
+  size_t klen;
+  size_t ksize;
+  struct outbuf line;   /* the --count format is made here */
+};
+
+static void out_init(struct outbuf *ob, FILE *stream)
+{
+  memset(ob, 0, sizeof(*ob));
+  ob->stream = stream;
+  ob->buf = malloc(OUTBUF_SIZE);
+  if(ob->buf)
+    ob->size = OUTBUF_SIZE;
+}
+
+static void out_free(struct outbuf *ob)
+{
+  free(ob->buf);
+  memset(ob, 0, sizeof(*ob));
+}
+
+#ifdef USE_COMPRESSION
+/* compresses the data and writes what comes out of it to the stream */
+static void pack_write(struct packer *p, const char *data, size_t len,
+                       enum packflush flush)
+{
+  if(p->failed || (!len && !p->pending && (flush == PACK_FLUSH)))
+    return;
+  p->pending = (flush == PACK_DATA);
+#ifdef HAVE_ZLIB
+  if(p->type == PACK_GZIP) {
+    int mode = (flush == PACK_FINISH) ? Z_FINISH :
+      (flush == PACK_FLUSH) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+    do {
+      /* avail_in is an unsigned int */
+      size_t chunk = (len < PACK_BLOCK) ? len : PACK_BLOCK;
+      p->zs.next_in = (const Bytef *)data;
+      p->zs.avail_in = (uInt)chunk;
+      data += chunk;
+      len -= chunk;
+      do {
+        p->zs.next_out = p->buf;
+        p->zs.avail_out = PACK_BLOCK;
+        if(deflate(&p->zs, len ? Z_NO_FLUSH : mode) == Z_STREAM_ERROR) {
+          p->failed = true;
+          return;
+        }
+        fwrite(p->buf, 1, PACK_BLOCK - p->zs.avail_out, p->stream);
+      } while(!p->zs.avail_out);
+    } while(len);
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if(p->type == PACK_ZSTD) {
+    ZSTD_EndDirective end = (flush == PACK_FINISH) ? ZSTD_e_end :
+      (flush == PACK_FLUSH) ? ZSTD_e_flush : ZSTD_e_continue;
+    ZSTD_inBuffer in;
+    in.src = data;
+    in.size = len;
+    in.pos = 0;
+    for(;;) {
+      ZSTD_outBuffer out;
+      size_t left;
+      out.dst = p->buf;
+      out.size = PACK_BLOCK;
+      out.pos = 0;
+      left = ZSTD_compressStream2(p->zc, &out, &in, end);
+      if(ZSTD_isError(left)) {
+        p->failed = true;
+        return;
+      }
+      fwrite(p->buf, 1, out.pos, p->stream);
+      /* without a flush, the rest can wait in the compressor */
+      if((end == ZSTD_e_continue) ? (in.pos == in.size) : !left)
+        break;
+    }
+  }
+#endif
+}
+#endif
+
+static void out_emit(struct outbuf *ob, const char *data, size_t len)
+{
+#ifdef USE_COMPRESSION
+  if(ob->pack) {
+    pack_write(ob->pack, data, len, PACK_DATA);
+    return;
+  }
+#endif
+  if(ob->stream)
+    fwrite(data, 1, len, ob->stream);
+  else
+    ob->sink(ob->userp, data, len);
+}
+
+/* write everything, also what is held */
+static void out_flush(struct outbuf *ob)
+{
+  ob->held = false;
+  if(ob->stream) {
+#ifdef USE_COMPRESSION
+    if(ob->pack)
+      pack_write(ob->pack, ob->buf, ob->len, PACK_FLUSH);
+    else if(ob->len)
+#else
+    if(ob->len)
+#endif
+      fwrite(ob->buf, 1, ob->len, ob->stream);
+    fflush(ob->stream);
+    ob->len = 0;
+  }
+  else if(ob->sink) {
+    if(ob->len)
+      ob->sink(ob->userp, ob->buf, ob->len);
+    ob->len = 0;
+  }
+}
+
+#ifdef USE_COMPRESSION
+/* ends the compressed stream, after the last out_flush() */
+static void pack_end(struct outbuf *ob)
+{
+  struct packer *p = ob->pack;
+  if(!p)
+    return;
+  pack_write(p, NULL, 0, PACK_FINISH);
+  fflush(p->stream);
+#ifdef HAVE_ZLIB
+  if(p->type == PACK_GZIP)
+    deflateEnd(&p->zs);
+#endif
+#ifdef HAVE_ZSTD
+  if(p->type == PACK_ZSTD)
+    ZSTD_freeCStream(p->zc);
+#endif
+  free(p->buf);
+  free(p);
+  ob->pack = NULL;
+}
+#endif
+
+static void out_write(struct outbuf *ob, const char *data, size_t len)
+{
+  if(!len)
+    return;
+  if((ob->size - ob->len < len) && ob->held && ob->mark &&
+     (ob->stream || ob->sink)) {
+    /* write what is before the mark, the rest might get taken back */
+    out_emit(ob, ob->buf, ob->mark);
+    memmove(ob->buf, &ob->buf[ob->mark], ob->len - ob->mark);
+    ob->len -= ob->mark;
+    ob->mark = 0;
+  }
+  if(ob->size - ob->len < len) {
+    if((ob->stream || ob->sink) && !ob->held) {
+      out_flush(ob);
+      if(len > ob->size) {
+        /* too large to buffer */
+        out_emit(ob, data, len);
+        return;
+      }
+    }
+    else {
+      size_t size = ob->size ? ob->size : 4096;
+      char *n;
+      while(size - ob->len < len)
+        size *= 2;
+      n = realloc(ob->buf, size);
+      if(!n) {
+        ob->oom = true;
+        return;
+      }
+      ob->buf = n;
+      ob->size = size;
+    }
+  }
+  memcpy(&ob->buf[ob->len], data, len);
+  ob->len += len;
+}
+
+/* keep what is written from now on in the buffer, until released */
+static void out_hold(struct outbuf *ob)
+{
+  ob->mark = ob->len;
+  ob->held = true;
+}
+
+static void out_char(struct outbuf *ob, char c)
+{
+  if(ob->len < ob->size)
+    ob->buf[ob->len++] = c;
+  else
+    out_write(ob, &c, 1);
+}
+
+static void out_str(struct outbuf *ob, const char *str)
+{
+  out_write(ob, str, strlen(str));
+}
+
+static void out_vprintf(struct outbuf *ob, const char *fmt, va_list ap)
+{
+  char *str = curl_mvaprintf(fmt, ap);
+  if(str) {
+    out_str(ob, str);
+    curl_free(str);
+  }
+  else
+    ob->oom = true;
 }
 
+
 static void help(void)
 {
   int i;
@@ -234,15 +787,26 @@ static void help(void)
     "  -a, --append [component]=[data]  - append data to component\n"
     "      --accept-space               - give in to this URL abuse\n"
     "      --as-idn                     - encode hostnames in idn\n"
+    "      --columnar                   - binary column output\n"
+    "      --compress-output [type]     - gzip or zstd the output\n"
+    "      --count [{component}s]       - count the outputs of this format\n"
+    "      --count-keys                 - count the query keys\n"
+    "      --count-top [num]            - show only the num largest counts\n"
     "      --curl                       - only schemes supported by libcurl\n"
+    "      --filter-host [file]         - only URLs with the hosts in file\n"
+    "      --filter-invert              - only URLs the filters do not match\n"
+    "      --filter-scheme [schemes]    - only URLs with these schemes\n"
     "      --default-port               - add known default ports\n"
     "  -f, --url-file [file/-]          - read URLs from file or stdin\n"
     "  -g, --get [{component}s]         - output component(s)\n"
     "  -h, --help                       - this help\n"
     "      --iterate [component]=[list] - create multiple URL outputs\n"
     "      --json                       - output URL as JSON\n"
+    "      --jsonl                      - output one JSON object per line\n"
     "      --keep-port                  - keep known default ports\n"
+    "      --line-buffered              - flush the output after each URL\n"
     "      --no-guess-scheme            - require scheme in URLs\n"
+    "      --parallel [num]             - threads for --url-file, --iterate\n"
     "      --punycode                   - encode hostnames in punycode\n"
     "      --qtrim [what]               - trim the query\n"
     "      --query-separator [letter]   - if something else than '&'\n"
@@ -250,8 +814,15 @@ static void help(void)
     "      --redirect [URL]             - redirect to this\n"
     "      --replace [data]             - replaces a query [data]\n"
     "      --replace-append [data]      - appends a new query if not found\n"
+    "      --serve                      - answer requests read from stdin\n"
+    "      --serve-socket [path]        - answer requests on a unix socket\n"
     "  -s, --set [component]=[data]     - set component content\n"
     "      --sort-query                 - alpha-sort the query pairs\n"
+    "      --startup-stats              - show the cost of starting up\n"
+    "      --stats                      - show timing and counters at exit\n"
+    "      --unique                     - skip outputs shown before\n"
+    "      --unique-exact               - --unique without fingerprints\n"
+    "      --unique-max [num]           - --unique remembers num outputs\n"
     "      --url [URL]                  - URL to work with\n"
     "      --urlencode                  - show components URL encoded\n"
     "  -v, --version                    - show version\n"
@@ -289,6 +860,9 @@ static void show_version(void)
 #ifdef SUPPORTS_GET_EMPTY
   fprintf(stdout, " get-empty");
 #endif
+#if defined(USE_COMPRESSION) && defined(HAVE_ZLIB)
+  fprintf(stdout, " gzip");
+#endif
 #ifdef SUPPORTS_IMAP_OPTIONS
   if(supports_imap)
     fprintf(stdout, " imap-options");
@@ -318,17 +892,190 @@ static void show_version(void)
 #endif
   if(data->version_num >= 0x080f00)
     fprintf(stdout, " uppercase-hex");
+#if defined(USE_COMPRESSION) && defined(HAVE_ZSTD)
+  fprintf(stdout, " zstd");
+#endif
 
   fprintf(stdout, "\n");
   exit(0);
 }
 
-struct iterinfo {
-  CURLU *uh;
-  const char *part;
-  size_t plen;
-  char *ptr;
-  unsigned int varmask; /* sets 1 << [component] */
+/* an --iterate list, split into its items */
+struct iterlist {
+  const struct var *v;
+  bool urlencode;
+  char **items;
+  size_t nitems;
+};
+
+#define MIN_QPAIRS 32 /* initial query pair vector size */
+#define MIN_PARTS 16 /* initial component cache size */
+#define MAX_PARALLEL 256 /* most --parallel threads */
+
+struct job;
+struct stats;
+
+#define ARENA_BLOCK 16384 /* default arena block size */
+
+struct arenablock {
+  struct arenablock *next;
+  char *mem;
+  size_t size;
+  size_t used;
+};
+
+/* Memory for data that is only used while a single URL is processed. It is
+   released all at once with arena_reset() and the blocks are kept for the
+   next URL. Only used for strings, so there is no alignment. */
+struct arena {
+  struct arenablock *first;
+  struct arenablock *cur;
+};
+
+/* a component as returned by curl_url_get() with a set of flags. Kept
+   until the end of the URL lap, so repeated lookups are free. The value is
+   a view that is not zero terminated, into the input line, the arena or
+   the string libcurl returned. */
+struct urlpart {
+  const char *value;
+  size_t len;
+  char *curl; /* to curl_free(), if 'value' is from libcurl */
+  const char *dec; /* URL decoded value, made when first asked for */
+  size_t declen;
+  unsigned int flags;
+  CURLUPart part;
+  CURLUcode rc;
+};
+
+/* a URL that fastparse() took, pointing into the input line */
+struct fasturl {
+  const char *url;
+  const char *scheme;
+  const char *defport;
+  const char *host;
+  size_t hostlen;
+  const char *port;
+  size_t portlen; /* zero without a port */
+  const char *path;
+  size_t pathlen; /* zero without a path, which then is "/" */
+  const char *query; /* NULL without a query */
+  size_t querylen;
+  bool newquery; /* the query is not the one in 'url' */
+  bool active;   /* the handle does not have this URL */
+};
+
+#define COLUMNAR_ROWS 4096 /* max rows per --columnar batch */
+#define COLUMNAR_BYTES (64 * 1024 * 1024) /* max data per --columnar batch */
+
+/* a string column of a --columnar batch */
+struct column {
+  struct outbuf valid;   /* validity bitmap, one bit per row */
+  struct outbuf offsets; /* end offset of each row, uint32 */
+  struct outbuf data;
+  uint32_t rows;
+  unsigned char bits;    /* validity bits not stored yet */
+};
+
+/* the columns: url, the components, then the param keys and values */
+#define COL_KEY (NUM_COMPONENTS + 1)
+#define COL_VALUE (NUM_COMPONENTS + 2)
+#define NUM_COLUMNS (NUM_COMPONENTS + 3)
+
+/* a --columnar batch being collected */
+struct columns {
+  struct column col[NUM_COLUMNS];
+  struct outbuf params; /* end offset in the param columns per URL, uint32 */
+  size_t bytes;         /* data in all columns */
+};
+
+/* a query pair to --sort-query. The first SORTKEY_BYTES bytes of the pair
+   are case folded and packed big endian into 'prefix', so most pairs
+   compare with a single integer compare */
+struct sortkey {
+  uint64_t prefix;
+  const struct string *pair; /* encoded */
+  int index; /* position in the query, orders equal pairs */
+};
+
+/* working state for the URL currently processed, one per thread */
+struct urlctx {
+  struct string *qpairs; /* encoded */
+  struct string *qpairsdec; /* decoded */
+  struct sortkey *sortkeys; /* --sort-query */
+  int maxsortkeys;
+  int nqpairs; /* how many is stored */
+  int maxqpairs; /* how many there is room for */
+  struct arena arena; /* for the query pairs */
+  struct keyhash qindex[2]; /* pairs by key, encoded and decoded */
+  bool qindexed[2]; /* if the index is up to date */
+  struct urlpart *parts; /* components fetched for output */
+  int nparts;
+  int maxparts;
+  struct outbuf *out; /* output */
+  struct outbuf *err; /* notes and errors */
+  struct job *job; /* set when running a --parallel or --serve job */
+  struct columns cols; /* --columnar batch */
+  CURLU *uh; /* reused for every input URL */
+  struct stats *stats; /* set with --stats */
+  struct urlset seen; /* --unique */
+  struct counter counts; /* --count, --count-keys */
+  struct fasturl fast;
+  bool pooled; /* a --parallel worker, the output is made unique later */
+};
+
+/* a node in the --trim prefix trie */
+struct trienode {
+  int child;   /* first child, 0 for none */
+  int sibling; /* next node with the same parent, 0 for none */
+  unsigned char byte; /* upper case */
+  bool end;    /* a prefix ends here */
+};
+
+/* --trim rules, compiled once */
+struct trimrules {
+  struct string *exact; /* whole keys */
+  int nexact;
+  struct keyhash hash;  /* on the exact keys, case insensitive */
+  struct trienode *trie; /* key prefixes, node 0 is the root */
+  int ntrie;
+};
+
+/* a node in the --filter-host suffix trie, one per host name label */
+struct labelnode {
+  int child;   /* first child, 0 for none */
+  int sibling; /* next node with the same parent, 0 for none */
+  struct string label;
+  bool end;    /* a suffix ends here */
+};
+
+/* --filter-host names, compiled once */
+struct hostfilter {
+  char *data;           /* the file contents */
+  struct string *exact; /* whole host names */
+  int nexact;
+  struct keyhash hash;  /* on the exact names, case insensitive */
+  struct labelnode *trie; /* suffix labels from the right, node 0 is the
+                             root */
+  int ntrie;
+};
+
+/* --get format, compiled into a list of operations */
+enum getoptype {
+  GETOP_TEXT,      /* literal text */
+  GETOP_URL,       /* the full URL */
+  GETOP_COMPONENT, /* a URL component */
+  GETOP_QUERY      /* query key lookup */
+};
+
+struct getop {
+  enum getoptype type;
+  const char *str; /* text or query key */
+  size_t len;
+  const struct var *v; /* component */
+  int mods;
+  bool strict; /* fail on URL decode problems */
+  bool must; /* fail on missing component */
+  bool queryall;
 };
 
 struct option {
@@ -339,12 +1086,28 @@ struct option {
   struct curl_slist *trim_list;
   struct curl_slist *iter_list;
   struct curl_slist *replace_list;
+  struct curl_slist *filter_scheme;
+  const char *filter_host; /* file name */
   const char *redirect;
   const char *qsep;
   const char *format;
+  const char *socket; /* --serve-socket path */
+  struct getop *getops; /* compiled format */
+  int ngetops;
+  char *gettext; /* literal text used by the getops */
+  size_t getlen;
+  struct trimrules trim;
+  struct hostfilter filter;
+  struct iterlist *iters; /* compiled --iterate */
+  int niters;
+  unsigned int itermask; /* the iterated components */
   FILE *url;
+  struct urlctx *ctx;
+  unsigned int parallel; /* number of --url-file worker threads */
   bool urlopen;
   bool jsonout;
+  bool jsonlines; /* --jsonl, implies jsonout */
+  bool columnar;
   bool verify;
   bool accept_space;
   bool curl;
@@ -358,64 +1121,530 @@ struct option {
   bool end_of_options;
   bool quiet_warnings;
   bool force_replace;
+  bool line_buffered;
+  bool filter_invert;
+  bool fastparse; /* try fastparse() on the input URLs */
+  bool startup_stats;
+  bool stats;
+  bool count; /* --count, the format is the --get one */
+  bool count_keys;
+  size_t count_top; /* show only this many of the counts */
+  enum packtype compress; /* --compress-output */
+  bool unique; /* --unique, --unique-exact or --unique-max */
+  bool unique_exact;
+  size_t unique_max; /* forget the seen outputs after this many */
+  bool serve; /* --serve or --serve-socket */
+  bool restricted; /* options of a --serve request or of libtrurl */
+  unsigned int normparts; /* parts to normalize, bits of CURLUPart */
 
   /* -- stats -- */
   unsigned int urls;
 };
 
-static void trurl_warnf(struct option *o, const char *fmt, ...)
+/* a batch of --url-file lines handed to a worker thread, or a --serve
+   request */
+struct job {
+  char *lines;       /* zero terminated URLs stored back to back */
+  size_t used;       /* bytes used in 'lines' */
+  size_t alloc;      /* bytes allocated for 'lines' */
+  size_t nlines;     /* number of URLs in 'lines' */
+  CURLU *base;       /* or the URL to show --iterate combinations of */
+  size_t first;      /* the first combination */
+  size_t count;      /* number of combinations */
+  bool modified;     /* the --set components modified the URL */
+  struct record *recs; /* with --unique, the outputs in 'out' */
+  size_t nrecs;
+  size_t maxrecs;
+  struct outbuf out; /* output */
+  struct outbuf err; /* notes and errors */
+  unsigned int urls; /* number of URLs the output accounts for */
+  int exit_code;     /* non-zero if processing stopped with an error */
+  bool jsonsep;      /* first JSON object needs a comma unless first */
+  bool closeout;     /* terminate the output before exiting */
+  bool done;         /* processed, output is ready to get written */
+  jmp_buf jmp;
+};
+
+/* a monotonic clock in nanoseconds */
+static uint64_t nanotime(void)
 {
-  if(!o->quiet_warnings) {
-    va_list ap;
-    va_start(ap, fmt);
-    fputs(WARN_PREFIX, stderr);
-    vfprintf(stderr, fmt, ap);
-    fputs("\n", stderr);
-    va_end(ap);
-  }
+#ifdef _WIN32
+  LARGE_INTEGER count;
+  LARGE_INTEGER freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000 +
+    (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 /
+    (uint64_t)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
 }
 
-#define MAX_QPAIRS 1000
-struct string qpairs[MAX_QPAIRS]; /* encoded */
-struct string qpairsdec[MAX_QPAIRS]; /* decoded */
-int nqpairs; /* how many is stored */
+/* the stages of singleurl() that --stats times */
+enum stage {
+  STAGE_SETURL,
+  STAGE_SET,
+  STAGE_NORMALIZE,
+  STAGE_QPAIRS,
+  STAGE_TRIM,
+  STAGE_REPLACE,
+  STAGE_SORT,
+  STAGE_QUERY,
+  STAGE_VERIFY,
+  STAGE_OUTPUT,
+  NUM_STAGES
+};
 
-static void trurl_cleanup_options(struct option *o)
+static const char *const stagenames[NUM_STAGES] = {
+  "seturl", "set", "normalize", "extractqpairs", "trim", "replace",
+  "sortquery", "qpair2query", "revalidation", "output"
+};
+
+/* Stage times go into a log-linear histogram: eight buckets for each power
+   of two, so a percentile read from it is within 12.5% of the real one. */
+#define HIST_SUB 8
+#define HIST_BUCKETS (62 * HIST_SUB)
+#define MAX_URLCODE 64 /* CURLUcode values counted, higher ones as other */
+
+struct stagestats {
+  uint64_t count;
+  uint64_t ns;    /* total */
+  uint64_t maxns;
+  uint32_t hist[HIST_BUCKETS];
+};
+
+struct stats {
+  struct stagestats stage[NUM_STAGES];
+  uint64_t parsefail[MAX_URLCODE + 1]; /* failed seturl() by CURLUcode,
+                                          the last for unknown codes */
+  uint64_t urls;    /* input URLs */
+  uint64_t skipped; /* empty --url-file lines */
+  uint64_t filtered; /* dropped by --filter-host or --filter-scheme */
+  uint64_t fastparsed; /* taken by fastparse() */
+};
+
+/* libcurl allocations, counted with --stats */
+static uint64_t allocs;
+
+static int histbucket(uint64_t ns)
 {
-  if(!o)
-    return;
-  curl_slist_free_all(o->url_list);
-  curl_slist_free_all(o->set_list);
-  curl_slist_free_all(o->iter_list);
-  curl_slist_free_all(o->append_query);
-  curl_slist_free_all(o->trim_list);
-  curl_slist_free_all(o->replace_list);
-  curl_slist_free_all(o->append_path);
+  int e = 0;
+  if(ns < HIST_SUB)
+    return (int)ns;
+  while((ns >> e) >= 2 * HIST_SUB)
+    e++;
+  return (e + 1) * HIST_SUB + (int)((ns >> e) - HIST_SUB);
 }
 
-static void errorf_low(const char *fmt, va_list ap)
+/* the largest time that goes into the bucket */
+static uint64_t histvalue(int bucket)
 {
-  message_low(ERROR_PREFIX, "\n"
-              ERROR_PREFIX "Try " PROGNAME " -h for help\n", fmt, ap);
+  int e = bucket / HIST_SUB - 1;
+  if(e < 0)
+    return (uint64_t)bucket;
+  return ((uint64_t)(bucket % HIST_SUB + HIST_SUB + 1) << e) - 1;
 }
 
-static void errorf(struct option *o, int exit_code, const char *fmt, ...)
+/* the time a stage needed in 'permille' of the cases */
+static uint64_t histpercentile(const struct stagestats *st, int permille)
 {
-  va_list ap;
-  va_start(ap, fmt);
-  errorf_low(fmt, ap);
-  va_end(ap);
-  trurl_cleanup_options(o);
-  curl_global_cleanup();
-  exit(exit_code);
+  uint64_t want = (st->count * permille + 999) / 1000;
+  uint64_t sum = 0;
+  int i;
+  for(i = 0; i < HIST_BUCKETS; i++) {
+    sum += st->hist[i];
+    if(sum >= want)
+      return histvalue(i) < st->maxns ? histvalue(i) : st->maxns;
+  }
+  return st->maxns;
 }
 
-static char *xstrdup(struct option *o, const char *ptr)
+/* returns the time to pass for the next stage, zero without --stats */
+static uint64_t stagebegin(struct option *o)
 {
-  char *temp = strdup(ptr);
-  if(!temp)
+  return o->ctx->stats ? nanotime() : 0;
+}
+
+static uint64_t stagedone(struct option *o, enum stage stage, uint64_t start)
+{
+  struct stats *s = o->ctx->stats;
+  if(s) {
+    uint64_t now = nanotime();
+    uint64_t ns = now - start;
+    struct stagestats *st = &s->stage[stage];
+    st->count++;
+    st->ns += ns;
+    if(ns > st->maxns)
+      st->maxns = ns;
+    st->hist[histbucket(ns)]++;
+    return now;
+  }
+  return 0;
+}
+
+#ifdef USE_THREADS
+static void stats_merge(struct stats *to, const struct stats *from)
+{
+  int i;
+  int j;
+  for(i = 0; i < NUM_STAGES; i++) {
+    struct stagestats *t = &to->stage[i];
+    const struct stagestats *f = &from->stage[i];
+    t->count += f->count;
+    t->ns += f->ns;
+    if(f->maxns > t->maxns)
+      t->maxns = f->maxns;
+    for(j = 0; j < HIST_BUCKETS; j++)
+      t->hist[j] += f->hist[j];
+  }
+  for(i = 0; i <= MAX_URLCODE; i++)
+    to->parsefail[i] += from->parsefail[i];
+  to->urls += from->urls;
+  to->skipped += from->skipped;
+  to->filtered += from->filtered;
+  to->fastparsed += from->fastparsed;
+}
+#endif
+
+/* --stats, one line of JSON on stderr */
+static void showstats(struct option *o)
+{
+  struct stats *s = o->ctx->stats;
+  struct outbuf *ob = o->ctx->err;
+  char buf[256];
+  const char *sep = "";
+  int i;
+  if(!s)
+    return;
+  out_flush(o->ctx->out);
+  curl_msnprintf(buf, sizeof(buf),
+                 "{\"urls\":%" CURL_FORMAT_CURL_OFF_TU ","
+                 "\"outputs\":%u,"
+                 "\"skipped_lines\":%" CURL_FORMAT_CURL_OFF_TU ","
+                 "\"filtered\":%" CURL_FORMAT_CURL_OFF_TU ","
+                 "\"fast_parsed\":%" CURL_FORMAT_CURL_OFF_TU ","
+                 "\"parse_failures\":[",
+                 (curl_off_t)s->urls, o->urls, (curl_off_t)s->skipped,
+                 (curl_off_t)s->filtered, (curl_off_t)s->fastparsed);
+  out_str(ob, buf);
+  for(i = 0; i < MAX_URLCODE; i++) {
+    if(s->parsefail[i]) {
+      curl_msnprintf(buf, sizeof(buf),
+                     "%s{\"code\":%d,\"error\":\"%s\","
+                     "\"count\":%" CURL_FORMAT_CURL_OFF_TU "}",
+                     sep, i, curl_url_strerror((CURLUcode)i),
+                     (curl_off_t)s->parsefail[i]);
+      out_str(ob, buf);
+      sep = ",";
+    }
+  }
+  if(s->parsefail[MAX_URLCODE]) {
+    /* codes newer than this trurl knows */
+    curl_msnprintf(buf, sizeof(buf),
+                   "%s{\"code\":null,\"error\":\"other\","
+                   "\"count\":%" CURL_FORMAT_CURL_OFF_TU "}",
+                   sep, (curl_off_t)s->parsefail[MAX_URLCODE]);
+    out_str(ob, buf);
+  }
+  out_str(ob, "],\"stages\":{");
+  for(i = 0; i < NUM_STAGES; i++) {
+    const struct stagestats *st = &s->stage[i];
+    curl_msnprintf(buf, sizeof(buf),
+                   "%s\"%s\":{\"count\":%" CURL_FORMAT_CURL_OFF_TU ","
+                   "\"total_ns\":%" CURL_FORMAT_CURL_OFF_TU ","
+                   "\"p50_ns\":%" CURL_FORMAT_CURL_OFF_TU ","
+                   "\"p90_ns\":%" CURL_FORMAT_CURL_OFF_TU ","
+                   "\"p99_ns\":%" CURL_FORMAT_CURL_OFF_TU ","
+                   "\"max_ns\":%" CURL_FORMAT_CURL_OFF_TU "}",
+                   i ? "," : "", stagenames[i],
+                   (curl_off_t)st->count, (curl_off_t)st->ns,
+                   (curl_off_t)histpercentile(st, 500),
+                   (curl_off_t)histpercentile(st, 900),
+                   (curl_off_t)histpercentile(st, 990),
+                   (curl_off_t)st->maxns);
+    out_str(ob, buf);
+  }
+  curl_msnprintf(buf, sizeof(buf),
+                 "},\"libcurl_allocs\":%" CURL_FORMAT_CURL_OFF_TU ","
+                 "\"libcurl_allocs_per_url\":%.2f}\n",
+                 (curl_off_t)allocs,
+                 s->urls ? (double)allocs / (double)s->urls : 0.0);
+  out_str(ob, buf);
+  out_flush(ob);
+}
+
+/* Notes are shown immediately. Pending output is flushed first to keep
+   them in order with the output. */
+static void message_low(struct option *o, const char *prefix,
+                        const char *suffix, const char *fmt, va_list ap)
+{
+  struct outbuf *ob = o->ctx->err;
+  out_flush(o->ctx->out);
+  out_str(ob, prefix);
+  out_vprintf(ob, fmt, ap);
+  out_str(ob, suffix);
+  out_flush(ob);
+}
+
+static void warnf_low(struct option *o, const char *fmt, va_list ap)
+{
+  message_low(o, WARN_PREFIX, "\n", fmt, ap);
+}
+
+/* a note that --quiet does not hide */
+static void warnf(struct option *o, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  warnf_low(o, fmt, ap);
+  va_end(ap);
+}
+
+static void trurl_warnf(struct option *o, const char *fmt, ...)
+{
+  if(!o->quiet_warnings) {
+    va_list ap;
+    va_start(ap, fmt);
+    warnf_low(o, fmt, ap);
+    va_end(ap);
+  }
+}
+
+static void trurl_cleanup_options(struct option *o)
+{
+  int i;
+  if(!o)
+    return;
+  curl_slist_free_all(o->url_list);
+  curl_slist_free_all(o->set_list);
+  curl_slist_free_all(o->iter_list);
+  curl_slist_free_all(o->append_query);
+  curl_slist_free_all(o->trim_list);
+  curl_slist_free_all(o->replace_list);
+  curl_slist_free_all(o->append_path);
+  curl_slist_free_all(o->filter_scheme);
+  free(o->getops);
+  free(o->gettext);
+  free(o->trim.exact);
+  keyhash_free(&o->trim.hash);
+  free(o->trim.trie);
+  free(o->filter.data);
+  free(o->filter.exact);
+  keyhash_free(&o->filter.hash);
+  free(o->filter.trie);
+  if(o->iters)
+    for(i = 0; i < o->niters; i++)
+      free(o->iters[i].items);
+  free(o->iters);
+}
+
+static void errorf_low(struct option *o, const char *fmt, va_list ap)
+{
+#ifdef TRURL_LIBRARY
+  /* there is no --help in a library context */
+  message_low(o, ERROR_PREFIX, "\n", fmt, ap);
+#else
+  message_low(o, ERROR_PREFIX, "\n"
+              ERROR_PREFIX "Try " PROGNAME " -h for help\n", fmt, ap);
+#endif
+}
+
+/* stop processing and exit. In a --parallel worker thread, this instead
+   hands over the exit code to the main thread that exits once all output
+   from the preceding URLs has been written. A --serve request ends with
+   the exit code as its status. */
+static void bailout(struct option *o, int exit_code)
+{
+  struct job *job = o->ctx ? o->ctx->job : NULL;
+  if(job) {
+    job->exit_code = exit_code;
+    job->urls = o->urls;
+    longjmp(job->jmp, 1);
+  }
+  if(o->ctx) {
+    showstats(o);
+    out_flush(o->ctx->out);
+#ifdef USE_COMPRESSION
+    pack_end(o->ctx->out);
+#endif
+  }
+  trurl_cleanup_options(o);
+  exit(exit_code);
+}
+
+static void errorf(struct option *o, int exit_code, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  errorf_low(o, fmt, ap);
+  va_end(ap);
+  bailout(o, exit_code);
+}
+
+static char *arena_alloc(struct option *o, size_t len)
+{
+  struct arena *a = &o->ctx->arena;
+  struct arenablock *b = a->cur;
+  char *ptr;
+
+  /* blocks after the current one are unused */
+  while(b && (b->size - b->used < len))
+    b = b->next;
+  if(!b) {
+    size_t size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+    b = malloc(sizeof(struct arenablock) + size);
+    if(!b)
+      errorf(o, ERROR_MEM, "out of memory");
+    b->mem = (char *)&b[1];
+    b->size = size;
+    b->used = 0;
+    b->next = NULL;
+    if(a->cur) {
+      /* append last in the list */
+      struct arenablock *last = a->cur;
+      while(last->next)
+        last = last->next;
+      last->next = b;
+    }
+    else
+      a->first = b;
+  }
+  a->cur = b;
+  ptr = &b->mem[b->used];
+  b->used += len;
+  return ptr;
+}
+
+/* copy the data into the arena, zero terminated */
+static char *arena_memdup(struct option *o, const char *ptr, size_t len)
+{
+  char *dupe = arena_alloc(o, len + 1);
+  memcpy(dupe, ptr, len);
+  dupe[len] = 0;
+  return dupe;
+}
+
+static void arena_reset(struct arena *a)
+{
+  struct arenablock *b;
+  for(b = a->first; b; b = b->next)
+    b->used = 0;
+  a->cur = a->first;
+}
+
+static void arena_free(struct arena *a)
+{
+  struct arenablock *b = a->first;
+  while(b) {
+    struct arenablock *next = b->next;
+    free(b);
+    b = next;
+  }
+  a->first = a->cur = NULL;
+}
+
+static void out_u32(struct outbuf *ob, uint32_t value)
+{
+  /* little endian */
+  char b[4];
+  b[0] = (char)(value & 0xff);
+  b[1] = (char)((value >> 8) & 0xff);
+  b[2] = (char)((value >> 16) & 0xff);
+  b[3] = (char)((value >> 24) & 0xff);
+  out_write(ob, b, sizeof(b));
+}
+
+/* write the --columnar stream header */
+static void colheader(struct outbuf *ob)
+{
+  int i;
+  out_write(ob, "TRURLCOL", 8);
+  out_u32(ob, 1); /* version */
+  out_u32(ob, NUM_COLUMNS);
+  out_u32(ob, 3);
+  out_write(ob, "url", 3);
+  for(i = 0; variables[i].name; i++) {
+    out_u32(ob, (uint32_t)strlen(variables[i].name));
+    out_str(ob, variables[i].name);
+  }
+  out_u32(ob, 9);
+  out_write(ob, "param_key", 9);
+  out_u32(ob, 11);
+  out_write(ob, "param_value", 11);
+}
+
+static void coladd(struct option *o, struct column *col,
+                   const char *data, size_t len, bool valid)
+{
+  struct columns *t = &o->ctx->cols;
+  if(valid)
+    col->bits |= (unsigned char)(1 << (col->rows & 7));
+  if(!(++col->rows & 7)) {
+    out_char(&col->valid, (char)col->bits);
+    col->bits = 0;
+  }
+  out_write(&col->data, data, len);
+  out_u32(&col->offsets, (uint32_t)col->data.len);
+  t->bytes += len;
+  if(col->valid.oom || col->offsets.oom || col->data.oom)
     errorf(o, ERROR_MEM, "out of memory");
-  return temp;
+}
+
+static void colwrite(struct outbuf *ob, struct column *col)
+{
+  if(col->rows & 7)
+    out_char(&col->valid, (char)col->bits);
+  out_write(ob, col->valid.buf, col->valid.len);
+  out_u32(ob, 0);
+  out_write(ob, col->offsets.buf, col->offsets.len);
+  out_write(ob, col->data.buf, col->data.len);
+  col->valid.len = col->offsets.len = col->data.len = 0;
+  col->rows = 0;
+  col->bits = 0;
+}
+
+/* write the collected rows as one batch */
+static void colflush(struct option *o)
+{
+  struct columns *t = &o->ctx->cols;
+  struct outbuf *ob = o->ctx->out;
+  int i;
+  if(!t->col[0].rows)
+    return;
+  out_u32(ob, t->col[0].rows);
+  out_u32(ob, t->col[COL_KEY].rows);
+  for(i = 0; i < COL_KEY; i++)
+    colwrite(ob, &t->col[i]);
+  out_u32(ob, 0);
+  out_write(ob, t->params.buf, t->params.len);
+  t->params.len = 0;
+  colwrite(ob, &t->col[COL_KEY]);
+  colwrite(ob, &t->col[COL_VALUE]);
+  t->bytes = 0;
+}
+
+static void colfree(struct columns *t)
+{
+  int i;
+  for(i = 0; i < NUM_COLUMNS; i++) {
+    out_free(&t->col[i].valid);
+    out_free(&t->col[i].offsets);
+    out_free(&t->col[i].data);
+  }
+  out_free(&t->params);
+}
+
+/* terminate the JSON array or the --columnar stream */
+static void closeoutput(struct option *o, struct outbuf *ob,
+                        unsigned int urls)
+{
+  if(o->columnar)
+    out_u32(ob, 0);
+  else if(o->jsonout && !o->jsonlines)
+    out_str(ob, urls ? "\n]\n" : "]\n");
 }
 
 static void verify(struct option *o, int exit_code, const char *fmt, ...)
@@ -423,27 +1652,23 @@ static void verify(struct option *o, int exit_code, const char *fmt, ...)
   va_list ap;
   va_start(ap, fmt);
   if(!o->verify) {
-    warnf_low(fmt, ap);
+    warnf_low(o, fmt, ap);
     va_end(ap);
   }
   else {
-    /* make sure to terminate the JSON array */
-    if(o->jsonout)
-      printf("%s]\n", o->urls ? "\n" : "");
-    errorf_low(fmt, ap);
+    /* make sure to terminate the JSON array or the --columnar stream */
+    if(o->columnar)
+      colflush(o);
+    if(o->ctx->job)
+      o->ctx->job->closeout = true;
+    else
+      closeoutput(o, o->ctx->out, o->urls);
+    errorf_low(o, fmt, ap);
     va_end(ap);
-    trurl_cleanup_options(o);
-    curl_global_cleanup();
-    exit(exit_code);
+    bailout(o, exit_code);
   }
 }
 
-static char *strurldecode(const char *url, int inlength, int *outlength)
-{
-  return curl_easy_unescape(NULL, inlength ? url : "", inlength,
-                            outlength);
-}
-
 static void urladd(struct option *o, const char *url)
 {
   struct curl_slist *n;
@@ -460,16 +1685,42 @@ static void urlfile(struct option *o, const char *file)
   if(o->url)
     errorf(o, ERROR_FLAG, "only one --url-file is supported");
   if(strcmp("-", file)) {
+#ifdef USE_COMPRESSION
+    /* compressed data is read as is, the reader handles CRLF */
+    f = fopen(file, "rb");
+#else
     f = fopen(file, "rt");
+#endif
     if(!f)
       errorf(o, ERROR_FILE, "--url-file %s not found", file);
     o->urlopen = true;
   }
-  else
+  else {
     f = stdin;
+#if defined(_WIN32) && defined(USE_COMPRESSION)
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  }
   o->url = f;
 }
 
+/* the --compress-output formats this trurl is built with */
+static enum packtype packtype(const char *name)
+{
+#ifdef USE_COMPRESSION
+#ifdef HAVE_ZLIB
+  if(!strcmp(name, "gzip"))
+    return PACK_GZIP;
+#endif
+#ifdef HAVE_ZSTD
+  if(!strcmp(name, "zstd"))
+    return PACK_ZSTD;
+#endif
+#endif
+  (void)name;
+  return PACK_NONE;
+}
+
 static void pathadd(struct option *o, const char *path)
 {
   struct curl_slist *n;
@@ -549,6 +1800,28 @@ static void trimadd(struct option *o,
     o->trim_list = n;
 }
 
+/* --filter-scheme "http https" */
+static void schemeadd(struct option *o, const char *list)
+{
+  while(*list) {
+    size_t len = strcspn(list, " ");
+    if(len) {
+      struct curl_slist *n;
+      char *scheme = curl_maprintf("%.*s", (int)len, list);
+      if(!scheme)
+        errorf(o, ERROR_MEM, "out of memory");
+      n = curl_slist_append(o->filter_scheme, scheme);
+      curl_free(scheme);
+      if(!n)
+        errorf(o, ERROR_MEM, "out of memory");
+      o->filter_scheme = n;
+    }
+    list += len;
+    if(*list)
+      list++;
+  }
+}
+
 static void replaceadd(struct option *o,
                        const char *replace_list) /* [component]=[data] */
 {
@@ -589,6 +1862,24 @@ static bool checkoptarg(struct option *o, const char *flag,
   return false;
 }
 
+/* options that only work on the command line, not in --serve requests or
+   in libtrurl */
+static bool cmdlineonly(const char *flag)
+{
+  static const char *const flags[] = {
+    "-f", "--url-file", "--parallel", "--serve", "--serve-socket",
+    "-h", "--help", "-v", "--version", "--stats", "--compress-output",
+    "--filter-host", NULL
+  };
+  int i;
+  for(i = 0; flags[i]; i++) {
+    if(flags[i][1] == '-' ? longarg(flags[i], flag) :
+       !strncmp(flags[i], flag, 2))
+      return true;
+  }
+  return false;
+}
+
 static int getarg(struct option *o,
                   const char *flag,
                   const char *arg,
@@ -597,6 +1888,12 @@ static int getarg(struct option *o,
   bool gap = true;
   *usedarg = false;
 
+  if(o->restricted && cmdlineonly(flag)) {
+    size_t not_e = flag[1] == '-' ? strcspn(flag, "=") : 2;
+    errorf(o, ERROR_FLAG, "%.*s is only supported on the command line",
+           (int)not_e, flag);
+  }
+
   if((flag[0] == '-') && (flag[1] != '-') && flag[2]) {
     arg = (char *)&flag[2];
     gap = false;
@@ -653,6 +1950,48 @@ static int getarg(struct option *o,
     o->qsep = arg;
     *usedarg = gap;
   }
+  else if(checkoptarg(o, "--parallel", flag, arg)) {
+    char *endp;
+    unsigned long num = strtoul(arg, &endp, 10);
+    if(*endp || (endp == arg) || !num || (num > MAX_PARALLEL))
+      errorf(o, ERROR_FLAG, "--parallel needs a number between 1 and %u",
+             MAX_PARALLEL);
+#ifndef USE_THREADS
+    trurl_warnf(o, "built without thread support, --parallel does not work");
+#endif
+    o->parallel = (unsigned int)num;
+    *usedarg = gap;
+  }
+  else if(checkoptarg(o, "--count", flag, arg)) {
+    if(o->format)
+      errorf(o, ERROR_FLAG, "only one --get or --count is supported");
+    o->format = arg;
+    o->count = true;
+    *usedarg = gap;
+  }
+  else if(checkoptarg(o, "--compress-output", flag, arg)) {
+    o->compress = packtype(arg);
+    if(!o->compress)
+      errorf(o, ERROR_FLAG, "--compress-output %s is not supported", arg);
+    *usedarg = gap;
+  }
+  else if(checkoptarg(o, "--count-top", flag, arg)) {
+    char *endp;
+    unsigned long long num = strtoull(arg, &endp, 10);
+    if(*endp || (endp == arg) || !num || (num > SIZE_MAX))
+      errorf(o, ERROR_FLAG, "--count-top needs a positive number");
+    o->count_top = (size_t)num;
+    *usedarg = gap;
+  }
+  else if(checkoptarg(o, "--unique-max", flag, arg)) {
+    char *endp;
+    unsigned long long num = strtoull(arg, &endp, 10);
+    if(*endp || (endp == arg) || !num || (num > SIZE_MAX / 2))
+      errorf(o, ERROR_FLAG, "--unique-max needs a positive number");
+    o->unique = true;
+    o->unique_max = (size_t)num;
+    *usedarg = gap;
+  }
   else if(checkoptarg(o, "--trim", flag, arg)) {
     if(strncmp(arg, "query=", 6))
       errorf(o, ERROR_TRIM, "Unsupported trim component: %s", arg);
@@ -664,20 +2003,45 @@ static int getarg(struct option *o,
     trimadd(o, arg);
     *usedarg = gap;
   }
+  else if(checkoptarg(o, "--filter-host", flag, arg)) {
+    if(o->filter_host)
+      errorf(o, ERROR_FLAG, "only one --filter-host is supported");
+    o->filter_host = arg;
+    *usedarg = gap;
+  }
+  else if(checkoptarg(o, "--filter-scheme", flag, arg)) {
+    schemeadd(o, arg);
+    *usedarg = gap;
+  }
   else if(checkoptarg(o, "-g", flag, arg) ||
           checkoptarg(o, "--get", flag, arg)) {
     if(o->format)
       errorf(o, ERROR_FLAG, "only one --get is supported");
     if(o->jsonout)
       errorf(o, ERROR_FLAG,
-                   "--get is mutually exclusive with --json");
+             "--get is mutually exclusive with %s",
+             o->jsonlines ? "--jsonl" : "--json");
+    if(o->columnar)
+      errorf(o, ERROR_FLAG, "--get is mutually exclusive with --columnar");
     o->format = arg;
     *usedarg = gap;
   }
-  else if(!strcmp("--json", flag)) {
+  else if(!strcmp("--json", flag) || !strcmp("--jsonl", flag)) {
+    bool lines = !strcmp("--jsonl", flag);
     if(o->format)
-      errorf(o, ERROR_FLAG, "--json is mutually exclusive with --get");
+      errorf(o, ERROR_FLAG, "%s is mutually exclusive with --get", flag);
+    if(o->columnar)
+      errorf(o, ERROR_FLAG, "%s is mutually exclusive with --columnar", flag);
     o->jsonout = true;
+    o->jsonlines = lines;
+  }
+  else if(!strcmp("--columnar", flag)) {
+    if(o->format)
+      errorf(o, ERROR_FLAG, "--columnar is mutually exclusive with --get");
+    if(o->jsonout)
+      errorf(o, ERROR_FLAG, "--columnar is mutually exclusive with %s",
+             o->jsonlines ? "--jsonl" : "--json");
+    o->columnar = true;
   }
   else if(!strcmp("--verify", flag))
     o->verify = true;
@@ -711,6 +2075,30 @@ static int getarg(struct option *o,
     o->sort_query = true;
   else if(!strcmp("--urlencode", flag))
     o->urlencode = true;
+  else if(!strcmp("--filter-invert", flag))
+    o->filter_invert = true;
+  else if(!strcmp("--line-buffered", flag))
+    o->line_buffered = true;
+  else if(!strcmp("--startup-stats", flag))
+    o->startup_stats = true;
+  else if(!strcmp("--stats", flag))
+    o->stats = true;
+  else if(!strcmp("--count-keys", flag))
+    o->count_keys = true;
+  else if(!strcmp("--unique", flag))
+    o->unique = true;
+  else if(!strcmp("--unique-exact", flag))
+    o->unique = o->unique_exact = true;
+  else if(!strcmp("--serve", flag))
+    o->serve = true;
+  else if(checkoptarg(o, "--serve-socket", flag, arg)) {
+#ifdef _WIN32
+    errorf(o, ERROR_FLAG, "--serve-socket is not supported on Windows");
+#endif
+    o->serve = true;
+    o->socket = arg;
+    *usedarg = gap;
+  }
   else if(!strcmp("--quiet", flag))
     o->quiet_warnings = true;
   else if(!strcmp("--replace", flag)) {
@@ -728,19 +2116,64 @@ static int getarg(struct option *o,
   return 0;
 }
 
-static void showqkey(FILE *stream, const char *key, size_t klen,
-                     bool urldecode, bool showall)
+/* length of the key in a query pair */
+static size_t qkeylen(const struct string *qp)
+{
+  const char *sep = memchr(qp->str, '=', qp->len);
+  return sep ? (size_t)(sep - qp->str) : qp->len;
+}
+
+/* (re)build the key index for the encoded or decoded pairs */
+static void indexqpairs(struct option *o, int dec)
+{
+  struct urlctx *c = o->ctx;
+  struct keyhash *h = &c->qindex[dec];
+  const struct string *qp = dec ? c->qpairsdec : c->qpairs;
+  int i;
+  if(!keyhash_reset(h, c->nqpairs))
+    errorf(o, ERROR_MEM, "out of memory");
+  for(i = 0; i < c->nqpairs; i++)
+    if(!keyhash_add(h, i, hashkey(qp[i].str, qkeylen(&qp[i]), false)))
+      errorf(o, ERROR_MEM, "out of memory");
+  c->qindexed[dec] = true;
+}
+
+/* Find the next pair after 'prev' (-1 to start) with exactly this key in
+   the encoded or decoded pairs. Returns -1 when there are no more. */
+static int findqpair(struct option *o, int dec, const char *key, size_t klen,
+                     int prev)
 {
+  struct urlctx *c = o->ctx;
+  const struct string *qp = dec ? c->qpairsdec : c->qpairs;
   int i;
+  if(!c->qindexed[dec])
+    indexqpairs(o, dec);
+  if(prev < 0)
+    i = keyhash_first(&c->qindex[dec], hashkey(key, klen, false));
+  else
+    i = keyhash_next(&c->qindex[dec], prev);
+  for(; i >= 0; i = keyhash_next(&c->qindex[dec], i)) {
+    /* skip pairs that are deleted or have other keys */
+    if(qp[i].len && (qkeylen(&qp[i]) == klen) &&
+       !memcmp(qp[i].str, key, klen))
+      break;
+  }
+  return i;
+}
+
+static void showqkey(struct option *o, const char *key, size_t klen,
+                     bool urldecode, bool showall)
+{
+  int i = -1;
   bool shown = false;
-  struct string *qp = urldecode ? qpairsdec : qpairs;
+  struct outbuf *ob = o->ctx->out;
+  struct string *qp = urldecode ? o->ctx->qpairsdec : o->ctx->qpairs;
 
-  for(i = 0; i< nqpairs; i++) {
-    if(!strncmp(key, qp[i].str, klen) && (qp[i].str[klen] == '=')) {
+  while((i = findqpair(o, urldecode, key, klen, i)) >= 0) {
+    if(qp[i].str[klen] == '=') {
       if(shown)
-        fputc(' ', stream);
-      fprintf(stream, "%.*s", (int) (qp[i].len - klen - 1),
-              &qp[i].str[klen + 1]);
+        out_char(ob, ' ');
+      out_write(ob, &qp[i].str[klen + 1], qp[i].len - klen - 1);
       if(!showall)
         break;
       shown = true;
@@ -759,95 +2192,404 @@ static const struct var *comp2var(const char *name, size_t vlen)
   return NULL;
 }
 
-static CURLUcode geturlpart(struct option *o, int modifiers, CURLU *uh,
-                            CURLUPart part, char **out)
+/* forget the fetched components */
+static void clearparts(struct urlctx *c)
 {
-  CURLUcode rc =
-    curl_url_get(uh, part, out,
-                 (((modifiers & VARMODIFIER_DEFAULT) ||
-                   o->default_port) ?
-                  CURLU_DEFAULT_PORT :
-                  ((part != CURLUPART_URL || o->keep_port) ?
-                   0 : CURLU_NO_DEFAULT_PORT))|
-#ifdef SUPPORTS_PUNYCODE
-                 (((modifiers & VARMODIFIER_PUNY) || o->punycode) ?
-                  CURLU_PUNYCODE : 0)|
-#endif
-#ifdef SUPPORTS_PUNY2IDN
-                 (((modifiers & VARMODIFIER_PUNY2IDN) || o->puny2idn) ?
-                  CURLU_PUNY2IDN : 0) |
-#endif
-#ifdef SUPPORTS_GET_EMPTY
-                 ((modifiers & VARMODIFIER_EMPTY) ? CURLU_GET_EMPTY : 0) |
-#endif
-                 (o->curl ? 0 : CURLU_NON_SUPPORT_SCHEME)|
-                 (((modifiers & VARMODIFIER_URLENCODED) ||
-                   o->urlencode) ?
-                  0 :CURLU_URLDECODE));
-
-#ifdef SUPPORTS_PUNY2IDN
-  /* retry get w/ out puny2idn to handle invalid punycode conversions */
-  if(rc == CURLUE_BAD_HOSTNAME &&
-     (o->puny2idn || (modifiers & VARMODIFIER_PUNY2IDN))) {
-    curl_free(*out);
-    modifiers &= ~VARMODIFIER_PUNY2IDN;
-    o->puny2idn = false;
-    trurl_warnf(o,
-                "Error converting url to IDN [%s]",
-                curl_url_strerror(rc));
-    return geturlpart(o, modifiers, uh, part, out);
+  int i;
+  for(i = 0; i < c->nparts; i++) {
+    /* the decoded values are in the arena */
+    curl_free(c->parts[i].curl);
   }
-#endif
+  c->nparts = 0;
+}
+
+static CURLUcode seturl(struct option *o, CURLU *uh, const char *url)
+{
+  CURLUcode rc = curl_url_set(uh, CURLUPART_URL, url,
+                              (o->no_guess_scheme ?
+                               0 : CURLU_GUESS_SCHEME)|
+                              (o->curl ? 0 : CURLU_NON_SUPPORT_SCHEME)|
+                              (o->accept_space ?
+                               CURLU_ALLOW_SPACE : 0)|
+                              CURLU_URLENCODE);
+  if(rc && o->ctx->stats)
+    o->ctx->stats->parsefail[rc < MAX_URLCODE ? rc : MAX_URLCODE]++;
   return rc;
 }
 
-static bool is_valid_trurl_error(CURLUcode rc)
+/* Parse the common http(s)://host[:port][/path][?query] shape without
+   libcurl. Only takes URLs that libcurl would store exactly as they are and
+   that trurl would not normalize: an ASCII host name that cannot be an IPv4
+   address, a port that is not the default one and a path without dot
+   segments or bytes that need encoding. Returns false for anything else,
+   which then goes to libcurl. */
+static bool fastparse(struct option *o, const char *url)
 {
-  switch(rc) {
-    case CURLUE_OK:
-    case CURLUE_NO_SCHEME:
-    case CURLUE_NO_USER:
-    case CURLUE_NO_PASSWORD:
-    case CURLUE_NO_OPTIONS:
-    case CURLUE_NO_HOST:
-    case CURLUE_NO_PORT:
-    case CURLUE_NO_QUERY:
-    case CURLUE_NO_FRAGMENT:
-#ifdef SUPPORTS_ZONEID
-    case CURLUE_NO_ZONEID:
-#endif
-    /* silently ignore */
+  struct fasturl *f = &o->ctx->fast;
+  const char *p;
+  const char *seg;
+  size_t label = 0;
+  bool name = false; /* a label does not start with a digit */
+  if(!strncmp(url, "https://", 8)) {
+    f->scheme = "https";
+    f->defport = "443";
+  }
+  else if(!strncmp(url, "http://", 7)) {
+    f->scheme = "http";
+    f->defport = "80";
+  }
+  else
+    return false;
+  f->host = p = &url[strlen(f->scheme) + 3];
+  for(;; p++) {
+    if(ISALNUM(*p) || (*p == '-')) {
+      if(!label++ && !ISDIGIT(*p))
+        name = true;
+    }
+    else if((*p == '.') && label)
+      label = 0;
+    else
+      break;
+  }
+  if(!label || !name)
+    return false;
+  f->hostlen = p - f->host;
+  f->portlen = 0;
+  if(*p == ':') {
+    unsigned int port = 0;
+    f->port = ++p;
+    if(*p == '0')
+      /* a leading zero or port zero */
       return false;
-    default:
-      return true;
+    while(ISDIGIT(*p) && (port <= 0xffff))
+      port = port * 10 + (unsigned int)(*p++ - '0');
+    f->portlen = p - f->port;
+    if(!f->portlen || (port > 0xffff) ||
+       ((f->portlen == strlen(f->defport)) &&
+        !strncmp(f->port, f->defport, f->portlen)))
+      return false;
+  }
+  if(*p && (*p != '/') && (*p != '?'))
+    return false;
+  f->path = seg = p;
+  for(;; p++) {
+    if(!*p || (*p == '/') || (*p == '?')) {
+      /* a "." or ".." segment */
+      if((seg < p) && (seg[1] == '.') &&
+         ((p - seg == 2) || ((p - seg == 3) && (seg[2] == '.'))))
+        return false;
+      if(*p != '/')
+        break;
+      seg = p;
     }
+    else if((*p == '%') && ISUPHEX(p[1]) && ISUPHEX(p[2])) {
+      unsigned char c = (unsigned char)((HEXVAL(p[1]) << 4) | HEXVAL(p[2]));
+      /* the canonical encoding of a byte that is not a control code */
+      if(urlsafe[c] || (c < 0x20))
+        return false;
+      p += 2;
+    }
+    else if(!urlsafe[(unsigned char)*p])
+      return false;
+  }
+  f->pathlen = p - f->path;
+  f->query = NULL;
+  if(*p == '?') {
+    f->query = ++p;
+    while((*p > 0x20) && (*p < 0x7f) && (*p != '#'))
+      p++;
+    if((p == f->query) || *p)
+      return false;
+    f->querylen = p - f->query;
+  }
+  else if(*p)
+    return false;
+  f->url = url;
+  f->newquery = false;
+  f->active = true;
+  if(o->ctx->stats)
+    o->ctx->stats->fastparsed++;
   return true;
 }
 
-static void showurl(FILE *stream, struct option *o, int modifiers,
-                    CURLU *uh)
+/* Give the handle the URL that fastparse() took, once something needs
+   libcurl for it */
+static void fastfallback(struct option *o, CURLU *uh)
 {
-  char *url;
-  CURLUcode rc = geturlpart(o, modifiers, uh, CURLUPART_URL, &url);
-  if(rc) {
-    trurl_cleanup_options(o);
-    verify(o, ERROR_BADURL, "invalid url [%s]", curl_url_strerror(rc));
-    return;
-  }
-  fputs(url, stream);
-  curl_free(url);
+  struct fasturl *f = &o->ctx->fast;
+  f->active = false;
+  (void)curl_url_set(uh, CURLUPART_URL, NULL, 0);
+  if(seturl(o, uh, f->url) ||
+     (f->newquery && curl_url_set(uh, CURLUPART_QUERY, f->query, 0)))
+    trurl_warnf(o, "internal problem: failed to store the URL [%s]", f->url);
 }
 
-static void get(struct option *o, CURLU *uh)
+/* Make a component of a fastparse() URL the way curl_url_get() would with
+   these flags. Returns false if libcurl needs to do it. */
+static bool fastpart(struct option *o, struct urlpart *p)
 {
-  FILE *stream = stdout;
-  const char *ptr = o->format;
-  bool done = false;
-  char startbyte = 0;
-  char endbyte = 0;
-
-  while(ptr && *ptr && !done) {
-    if(!startbyte && (('{' == *ptr) || ('[' == *ptr))) {
+  struct fasturl *f = &o->ctx->fast;
+  const char *str = NULL;
+  size_t len = 0;
+  char *out;
+  size_t olen;
+#ifdef SUPPORTS_PUNY2IDN
+  if(p->flags & CURLU_PUNY2IDN)
+    return false;
+#endif
+  switch(p->part) {
+  case CURLUPART_SCHEME:
+    str = f->scheme;
+    len = strlen(str);
+    break;
+  case CURLUPART_HOST:
+    str = f->host;
+    len = f->hostlen;
+    break;
+  case CURLUPART_PORT:
+    if(f->portlen) {
+      str = f->port;
+      len = f->portlen;
+    }
+    else if(p->flags & CURLU_DEFAULT_PORT) {
+      str = f->defport;
+      len = strlen(str);
+    }
+    else
+      p->rc = CURLUE_NO_PORT;
+    break;
+  case CURLUPART_PATH:
+    str = f->pathlen ? f->path : "/";
+    len = f->pathlen ? f->pathlen : 1;
+    break;
+  case CURLUPART_QUERY:
+    if(f->query) {
+      str = f->query;
+      len = f->querylen;
+    }
+    else
+      p->rc = CURLUE_NO_QUERY;
+    break;
+  case CURLUPART_URL: {
+    const char *port = f->portlen ? f->port :
+      ((p->flags & CURLU_DEFAULT_PORT) ? f->defport : NULL);
+    size_t plen = f->portlen ? f->portlen : (port ? strlen(port) : 0);
+    if(f->pathlen && !f->newquery && (port == f->port)) {
+      /* the input line is the URL */
+      p->value = f->url;
+      p->len = strlen(f->url);
+      return true;
+    }
+    /* with room for the ':', a "/" path and the '?' */
+    len = strlen(f->scheme) + 3 + f->hostlen + 1 + plen + f->pathlen + 1 +
+      1 + (f->query ? f->querylen : 0);
+    p->value = out = arena_alloc(o, len);
+    olen = strlen(f->scheme);
+    memcpy(out, f->scheme, olen);
+    memcpy(&out[olen], "://", 3);
+    olen += 3;
+    memcpy(&out[olen], f->host, f->hostlen);
+    olen += f->hostlen;
+    if(port) {
+      out[olen++] = ':';
+      memcpy(&out[olen], port, plen);
+      olen += plen;
+    }
+    if(f->pathlen) {
+      memcpy(&out[olen], f->path, f->pathlen);
+      olen += f->pathlen;
+    }
+    else
+      out[olen++] = '/';
+    if(f->query) {
+      out[olen++] = '?';
+      memcpy(&out[olen], f->query, f->querylen);
+      olen += f->querylen;
+    }
+    p->len = olen;
+    return true;
+  }
+  case CURLUPART_USER:
+    p->rc = CURLUE_NO_USER;
+    break;
+  case CURLUPART_PASSWORD:
+    p->rc = CURLUE_NO_PASSWORD;
+    break;
+  case CURLUPART_OPTIONS:
+    p->rc = CURLUE_NO_OPTIONS;
+    break;
+  case CURLUPART_FRAGMENT:
+    p->rc = CURLUE_NO_FRAGMENT;
+    break;
+#ifdef SUPPORTS_ZONEID
+  case CURLUPART_ZONEID:
+    p->rc = CURLUE_NO_ZONEID;
+    break;
+#endif
+  default:
+    return false;
+  }
+  if(!str)
+    return true;
+  p->value = str;
+  p->len = len;
+  if((p->flags & CURLU_URLDECODE) &&
+     (memchr(str, '%', len) ||
+      ((p->part == CURLUPART_QUERY) && memchr(str, '+', len)))) {
+    size_t i;
+    out = arena_alloc(o, len);
+    olen = urldecode(out, str, len, p->part == CURLUPART_QUERY);
+    for(i = 0; i < olen; i++)
+      if((unsigned char)out[i] < 0x20)
+        /* libcurl refuses to decode these */
+        return false;
+    p->value = out;
+    p->len = olen;
+  }
+  return true;
+}
+
+/* Get a component, from the cache if it was fetched with the same flags
+   before in this lap. The returned pointer is valid until the next call, the
+   strings in it until the end of the lap. */
+static struct urlpart *fetchpart(struct option *o, CURLU *uh,
+                                 CURLUPart part, unsigned int flags)
+{
+  struct urlctx *c = o->ctx;
+  struct urlpart *p;
+  int i;
+  for(i = 0; i < c->nparts; i++) {
+    p = &c->parts[i];
+    if((p->part == part) && (p->flags == flags))
+      return p;
+  }
+  if(c->nparts == c->maxparts) {
+    int max = c->maxparts ? c->maxparts * 2 : MIN_PARTS;
+    p = realloc(c->parts, max * sizeof(struct urlpart));
+    if(!p)
+      errorf(o, ERROR_MEM, "out of memory");
+    c->parts = p;
+    c->maxparts = max;
+  }
+  p = &c->parts[c->nparts++];
+  memset(p, 0, sizeof(*p));
+  p->part = part;
+  p->flags = flags;
+  if(!c->fast.active || !fastpart(o, p)) {
+    if(c->fast.active)
+      fastfallback(o, uh);
+    p->rc = curl_url_get(uh, part, &p->curl, flags);
+    p->value = p->curl;
+    p->len = p->curl ? strlen(p->curl) : 0;
+  }
+  return p;
+}
+
+static struct urlpart *geturlpart(struct option *o, int modifiers,
+                                  CURLU *uh, CURLUPart part)
+{
+  struct urlpart *p =
+    fetchpart(o, uh, part,
+              (((modifiers & VARMODIFIER_DEFAULT) ||
+                o->default_port) ?
+               CURLU_DEFAULT_PORT :
+               ((part != CURLUPART_URL || o->keep_port) ?
+                0 : CURLU_NO_DEFAULT_PORT))|
+#ifdef SUPPORTS_PUNYCODE
+              (((modifiers & VARMODIFIER_PUNY) || o->punycode) ?
+               CURLU_PUNYCODE : 0)|
+#endif
+#ifdef SUPPORTS_PUNY2IDN
+              (((modifiers & VARMODIFIER_PUNY2IDN) || o->puny2idn) ?
+               CURLU_PUNY2IDN : 0) |
+#endif
+#ifdef SUPPORTS_GET_EMPTY
+              ((modifiers & VARMODIFIER_EMPTY) ? CURLU_GET_EMPTY : 0) |
+#endif
+              (o->curl ? 0 : CURLU_NON_SUPPORT_SCHEME)|
+              (((modifiers & VARMODIFIER_URLENCODED) ||
+                o->urlencode) ?
+               0 :CURLU_URLDECODE));
+
+#ifdef SUPPORTS_PUNY2IDN
+  /* retry get w/ out puny2idn to handle invalid punycode conversions */
+  if(p->rc == CURLUE_BAD_HOSTNAME &&
+     (o->puny2idn || (modifiers & VARMODIFIER_PUNY2IDN))) {
+    modifiers &= ~VARMODIFIER_PUNY2IDN;
+    o->puny2idn = false;
+    trurl_warnf(o,
+                "Error converting url to IDN [%s]",
+                curl_url_strerror(p->rc));
+    return geturlpart(o, modifiers, uh, part);
+  }
+#endif
+  return p;
+}
+
+static bool is_valid_trurl_error(CURLUcode rc)
+{
+  switch(rc) {
+    case CURLUE_OK:
+    case CURLUE_NO_SCHEME:
+    case CURLUE_NO_USER:
+    case CURLUE_NO_PASSWORD:
+    case CURLUE_NO_OPTIONS:
+    case CURLUE_NO_HOST:
+    case CURLUE_NO_PORT:
+    case CURLUE_NO_QUERY:
+    case CURLUE_NO_FRAGMENT:
+#ifdef SUPPORTS_ZONEID
+    case CURLUE_NO_ZONEID:
+#endif
+    /* silently ignore */
+      return false;
+    default:
+      return true;
+    }
+  return true;
+}
+
+static void showurl(struct option *o, int modifiers, CURLU *uh)
+{
+  struct urlpart *p = geturlpart(o, modifiers, uh, CURLUPART_URL);
+  if(p->rc) {
+    verify(o, ERROR_BADURL, "invalid url [%s]", curl_url_strerror(p->rc));
+    return;
+  }
+  out_write(o->ctx->out, p->value, p->len);
+}
+
+/* add literal text to the compiled format */
+static void gettextadd(struct option *o, char byte)
+{
+  struct getop *op = o->ngetops ? &o->getops[o->ngetops - 1] : NULL;
+  if(!op || (op->type != GETOP_TEXT)) {
+    op = &o->getops[o->ngetops++];
+    memset(op, 0, sizeof(*op));
+    op->type = GETOP_TEXT;
+    op->str = &o->gettext[o->getlen];
+  }
+  o->gettext[o->getlen++] = byte;
+  op->len++;
+}
+
+/* parse the --get format once into the list of operations get() runs */
+static void compileget(struct option *o)
+{
+  const char *ptr = o->format;
+  size_t flen = strlen(ptr);
+  char startbyte = 0;
+  char endbyte = 0;
+
+  /* there cannot be more operations or text than there are bytes */
+  o->getops = malloc((flen + 1) * sizeof(struct getop));
+  o->gettext = malloc(flen + 1);
+  if(!o->getops || !o->gettext)
+    errorf(o, ERROR_MEM, "out of memory");
+  o->getlen = 0;
+
+  while(*ptr) {
+    if(!startbyte && (('{' == *ptr) || ('[' == *ptr))) {
       startbyte = *ptr;
       if('{' == *ptr)
         endbyte = '}';
@@ -857,25 +2599,27 @@ static void get(struct option *o, CURLU *uh)
     if(startbyte == *ptr) {
       if(startbyte == ptr[1]) {
         /* an escaped {-letter */
-        fputc(startbyte, stream);
+        gettextadd(o, startbyte);
         ptr += 2;
       }
       else {
         /* this is meant as a variable to output */
         const char *start = ptr;
-        char *end;
-        char *cl;
+        const char *end;
+        const char *cl;
         size_t vlen;
+        int errlen = (int)strlen(start);
+        struct getop *op;
         bool isquery = false;
         bool queryall = false;
-        bool strict = false; /* strict mode, fail on URL decode problems */
-        bool must = false; /* must mode, fail on missing component */
+        bool strict = false;
+        bool must = false;
         int mods = 0;
         end = strchr(ptr, endbyte);
         ptr++; /* pass the { */
         if(!end) {
           /* syntax error */
-          fputc(startbyte, stream);
+          gettextadd(o, startbyte);
           continue;
         }
 
@@ -923,9 +2667,9 @@ static void get(struct option *o, CURLU *uh)
             else if(!strncmp(ptr, "query:", wordlen))
               isquery = true;
             else {
-              /* syntax error */
+              /* syntax error, only show this variable */
               vlen = 0;
-              end[1] = '\0';
+              errlen = (int)(end - start + 1);
             }
             break;
           }
@@ -934,95 +2678,160 @@ static void get(struct option *o, CURLU *uh)
           vlen = end - ptr;
         } while(true);
 
+        op = &o->getops[o->ngetops];
+        memset(op, 0, sizeof(*op));
+        op->mods = mods;
+        op->strict = strict;
+        op->must = must;
         if(isquery) {
-          showqkey(stream, cl + 1, end - cl - 1,
-                   !o->urlencode && !(mods & VARMODIFIER_URLENCODED),
-                   queryall);
+          op->type = GETOP_QUERY;
+          op->str = cl + 1;
+          op->len = end - cl - 1;
+          op->queryall = queryall;
         }
         else if(!vlen)
-          errorf(o, ERROR_GET, "Bad --get syntax: %s", start);
+          errorf(o, ERROR_GET, "Bad --get syntax: %.*s", errlen, start);
         else if(!strncmp(ptr, "url", vlen))
-          showurl(stream, o, mods, uh);
+          op->type = GETOP_URL;
         else {
-          const struct var *v = comp2var(ptr, vlen);
-          if(v) {
-            char *nurl;
-            /* ask for it URL encode always, to avoid libcurl warning on
-               content */
-            CURLUcode rc = geturlpart(o, mods | VARMODIFIER_URLENCODED,
-                                      uh, v->part, &nurl);
-            if(!rc && !(mods & VARMODIFIER_URLENCODED) && !o->urlencode) {
-              /* it should not be encoded in the output */
-              int olen;
-              char *dec = curl_easy_unescape(NULL, nurl, 0, &olen);
-              curl_free(nurl);
-              if(memchr(dec, '\0', (size_t)olen)) {
-                /* a binary zero cannot be shown */
-                rc = CURLUE_URLDECODE;
-                curl_free(dec);
-                dec = NULL;
-              }
-              nurl = dec;
-            }
-
-            if(rc == CURLUE_OK) {
-              fputs(nurl, stream);
-              curl_free(nurl);
-            }
-            else if(!is_valid_trurl_error(rc) && must)
-              errorf(o, ERROR_GET, "missing must:%s", v->name);
-            else if(is_valid_trurl_error(rc) || strict) {
-              if((rc == CURLUE_URLDECODE) && strict)
-                errorf(o, ERROR_GET, "problems URL decoding %s", v->name);
-              else
-                trurl_warnf(o, "%s (%s)", curl_url_strerror(rc), v->name);
-            }
-          }
-          else
+          op->type = GETOP_COMPONENT;
+          op->v = comp2var(ptr, vlen);
+          if(!op->v)
             errorf(o, ERROR_GET, "\"%.*s\" is not a recognized URL component",
                    (int)vlen, ptr);
         }
+        o->ngetops++;
         ptr = end + 1; /* pass the end */
       }
     }
     else if('\\' == *ptr && ptr[1]) {
       switch(ptr[1]) {
       case 'r':
-        fputc('\r', stream);
+        gettextadd(o, '\r');
         break;
       case 'n':
-        fputc('\n', stream);
+        gettextadd(o, '\n');
         break;
       case 't':
-        fputc('\t', stream);
+        gettextadd(o, '\t');
         break;
       case '\\':
-        fputc('\\', stream);
+        gettextadd(o, '\\');
         break;
       case '{':
-        fputc('{', stream);
+        gettextadd(o, '{');
         break;
       case '[':
-        fputc('[', stream);
+        gettextadd(o, '[');
         break;
       default:
         /* unknown, just output this */
-        fputc(*ptr, stream);
-        fputc(ptr[1], stream);
+        gettextadd(o, *ptr);
+        gettextadd(o, ptr[1]);
         break;
       }
       ptr += 2;
     }
     else {
-      fputc(*ptr, stream);
+      gettextadd(o, *ptr);
       ptr++;
     }
   }
-  fputc('\n', stream);
 }
 
+static void getcomponent(struct option *o, const struct getop *op, CURLU *uh)
+{
+  const struct var *v = op->v;
+  int mods = op->mods;
+  /* ask for it URL encode always, to avoid libcurl warning on
+     content */
+  struct urlpart *p = geturlpart(o, mods | VARMODIFIER_URLENCODED,
+                                 uh, v->part);
+  CURLUcode rc = p->rc;
+  const char *nurl = p->value;
+  size_t nlen = p->len;
+  if(!rc && !(mods & VARMODIFIER_URLENCODED) && !o->urlencode) {
+    /* it should not be encoded in the output */
+    if(!p->dec) {
+      if(memchr(p->value, '%', p->len)) {
+        char *dec = arena_alloc(o, p->len);
+        p->declen = urldecode(dec, p->value, p->len, false);
+        p->dec = dec;
+      }
+      else {
+        /* nothing to decode */
+        p->dec = p->value;
+        p->declen = p->len;
+      }
+    }
+    if(memchr(p->dec, '\0', p->declen))
+      /* a binary zero cannot be shown */
+      rc = CURLUE_URLDECODE;
+    nurl = p->dec;
+    nlen = p->declen;
+  }
+
+  if(rc == CURLUE_OK)
+    out_write(o->ctx->out, nurl, nlen);
+  else if(!is_valid_trurl_error(rc) && op->must)
+    errorf(o, ERROR_GET, "missing must:%s", v->name);
+  else if(is_valid_trurl_error(rc) || op->strict) {
+    if((rc == CURLUE_URLDECODE) && op->strict)
+      errorf(o, ERROR_GET, "problems URL decoding %s", v->name);
+    else
+      trurl_warnf(o, "%s (%s)", curl_url_strerror(rc), v->name);
+  }
+}
+
+static void get(struct option *o, CURLU *uh)
+{
+  struct outbuf *ob = o->ctx->out;
+  int i;
+
+  for(i = 0; i < o->ngetops; i++) {
+    const struct getop *op = &o->getops[i];
+    switch(op->type) {
+    case GETOP_TEXT:
+      out_write(ob, op->str, op->len);
+      break;
+    case GETOP_URL:
+      showurl(o, op->mods, uh);
+      break;
+    case GETOP_COMPONENT:
+      getcomponent(o, op, uh);
+      break;
+    case GETOP_QUERY:
+      showqkey(o, op->str, op->len,
+               !o->urlencode && !(op->mods & VARMODIFIER_URLENCODED),
+               op->queryall);
+      break;
+    }
+  }
+  out_char(ob, '\n');
+}
+
+/* set a component, an empty value clears it. Returns true if it was set */
+static bool setpart(CURLU *uh, struct option *o, const struct var *v,
+                    const char *value, bool urlencode)
+{
+  CURLUcode rc;
+  if((v->part == CURLUPART_HOST) && ('[' == value[0]))
+    /* when setting an IPv6 numerical address, disable URL encoding */
+    urlencode = false;
+  rc = curl_url_set(uh, v->part, value[0] ? value : NULL,
+                    (o->curl ? 0 : CURLU_NON_SUPPORT_SCHEME)|
+                    (urlencode ? CURLU_URLENCODE : 0) );
+  if(rc) {
+    warnf(o, "Error setting %s: %s", v->name, curl_url_strerror(rc));
+    return false;
+  }
+  return true;
+}
+
+/* sets one component, '*changed' is set to true if the handle was
+   modified */
 static const struct var *setone(CURLU *uh, const char *setline,
-                                struct option *o)
+                                struct option *o, bool *changed)
 {
   char *ptr = strchr(setline, '=');
   const struct var *v = NULL;
@@ -1051,27 +2860,17 @@ static const struct var *setone(CURLU *uh, const char *setline,
     }
     v = comp2var(setline, vlen);
     if(v) {
-      CURLUcode rc = CURLUE_OK;
       bool skip = false;
-      if((v->part == CURLUPART_HOST) && ('[' == ptr[1]))
-        /* when setting an IPv6 numerical address, disable URL encoding */
-        urlencode = false;
-
       if(conditional) {
         char *piece;
-        rc = curl_url_get(uh, v->part, &piece, CURLU_NO_GUESS_SCHEME);
-        if(!rc) {
+        if(!curl_url_get(uh, v->part, &piece, CURLU_NO_GUESS_SCHEME)) {
           skip = true;
           curl_free(piece);
         }
       }
 
-      if(!skip)
-        rc = curl_url_set(uh, v->part, ptr[1] ? &ptr[1] : NULL,
-                          (o->curl ? 0 : CURLU_NON_SUPPORT_SCHEME)|
-                          (urlencode ? CURLU_URLENCODE : 0) );
-      if(rc)
-        warnf("Error setting %s: %s", v->name, curl_url_strerror(rc));
+      if(!skip && setpart(uh, o, v, &ptr[1], urlencode) && changed)
+        *changed = true;
       found = true;
     }
     if(!found)
@@ -1084,14 +2883,15 @@ static const struct var *setone(CURLU *uh, const char *setline,
 }
 
 static unsigned int set(CURLU *uh,
-                        struct option *o)
+                        struct option *o,
+                        bool *changed)
 {
   struct curl_slist *node;
   unsigned int mask = 0;
   for(node =  o->set_list; node; node = node->next) {
     const struct var *v;
     char *setline = node->data;
-    v = setone(uh, setline, o);
+    v = setone(uh, setline, o, changed);
     if(v) {
       if(mask & (1 << v->part))
         errorf(o, ERROR_SET,
@@ -1102,459 +2902,559 @@ static unsigned int set(CURLU *uh,
   return mask; /* the set components */
 }
 
-static void jsonString(FILE *stream, const char *in, size_t len,
-                       bool lowercase)
+/* how each byte is written in a JSON string: 0 as-is, 'u' as \u00XX or
+   otherwise a backslash followed by this letter */
+static const char jsonesc[256] = {
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', /* 0x00 */
+  'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', /* 0x10 */
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  0, 0, '\"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x20 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x30 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x40 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0 /* 0x50 */
+};
+
+#define BYTES_ONE  0x0101010101010101ULL
+#define BYTES_HIGH 0x8080808080808080ULL
+/* non-zero if any byte in the word is zero */
+#define HASZERO(w) (((w) - BYTES_ONE) & ~(w) & BYTES_HIGH)
+/* non-zero if any byte in the word needs escaping in JSON */
+#define JSONSPECIAL(w) ((((w) - BYTES_ONE * 0x20) & ~(w) & BYTES_HIGH) | \
+                        HASZERO((w) ^ (BYTES_ONE * '\"')) |              \
+                        HASZERO((w) ^ (BYTES_ONE * '\\')))
+
+static void jsonString(struct outbuf *ob, const char *in, size_t len)
 {
-  const unsigned char *i = (unsigned char *)in;
-  const char *in_end = &in[len];
-  fputc('\"', stream);
-  for(; i < (unsigned char *)in_end; i++) {
-    switch(*i) {
-    case '\\':
-      fputs("\\\\", stream);
-      break;
-    case '\"':
-      fputs("\\\"", stream);
-      break;
-    case '\b':
-      fputs("\\b", stream);
-      break;
-    case '\f':
-      fputs("\\f", stream);
-      break;
-    case '\n':
-      fputs("\\n", stream);
-      break;
-    case '\r':
-      fputs("\\r", stream);
-      break;
-    case '\t':
-      fputs("\\t", stream);
-      break;
-    default:
-      if(*i < 32)
-        fprintf(stream, "\\u%04x", *i);
+  const char *end = &in[len];
+  const char *safe = in; /* first byte not written yet */
+  out_char(ob, '\"');
+  while(in < end) {
+    char esc;
+    if((end - in) >= 8) {
+      /* skip eight bytes at once when none of them needs escaping */
+      uint64_t w;
+      memcpy(&w, in, sizeof(w));
+      if(!JSONSPECIAL(w)) {
+        in += 8;
+        continue;
+      }
+    }
+    esc = jsonesc[(unsigned char)*in];
+    if(esc) {
+      out_write(ob, safe, in - safe);
+      if(esc == 'u') {
+        const char hex[] = "0123456789abcdef";
+        char u[6] = { '\\', 'u', '0', '0', 0, 0 };
+        u[4] = hex[(unsigned char)*in >> 4];
+        u[5] = hex[*in & 0xf];
+        out_write(ob, u, sizeof(u));
+      }
       else {
-        char out = *i;
-        if(lowercase && (out >= 'A' && out <= 'Z'))
-          /* do not use tolower() since that's locale specific */
-          out |= ('a' - 'A');
-        fputc(out, stream);
+        char e[2] = { '\\', 0 };
+        e[1] = esc;
+        out_write(ob, e, sizeof(e));
       }
-      break;
+      safe = in + 1;
     }
+    in++;
+  }
+  out_write(ob, safe, end - safe);
+  out_char(ob, '\"');
+}
+
+/* A component as shown in JSON and --columnar output, URL decoded unless
+   --urlencode is used. Returns NULL if not available, with the reason. */
+static const char *partvalue(struct option *o, CURLU *uh,
+                             const struct var *v, size_t *lenp,
+                             CURLUcode *rcp)
+{
+  const char *part;
+  char *dec;
+  size_t len;
+  /* query parts have '+' for space */
+  bool plus = (v->part == CURLUPART_QUERY);
+  /* ask for the URL encoded version so that weird control characters do not
+     cause problems. URL decode it when push to json. */
+  struct urlpart *up = geturlpart(o, VARMODIFIER_URLENCODED, uh, v->part);
+  *rcp = up->rc;
+  if(up->rc)
+    return NULL;
+  part = up->value;
+  len = up->len;
+  if(o->urlencode ||
+     (!memchr(part, '%', len) && !(plus && memchr(part, '+', len)))) {
+    /* nothing to decode */
+    *lenp = len;
+    return part;
   }
-  fputc('\"', stream);
+  dec = arena_alloc(o, len);
+  *lenp = urldecode(dec, part, len, plus);
+  return dec;
 }
 
+/* the fixed parts of a JSON object, for --json and --jsonl */
+struct jsonframe {
+  const char *url;         /* before the URL */
+  const char *parts;       /* after the URL, before the first part */
+  const char *sep;         /* between parts and between params */
+  const char *name;        /* before a part name */
+  const char *value;       /* between a part name and its value */
+  const char *partsend;    /* after the last part */
+  const char *params;      /* before the first param */
+  const char *key;         /* before a param key */
+  const char *keyvalue;    /* between a param key and its value */
+  const char *paramend;    /* after each param */
+  const char *paramsend;   /* after the last param */
+  const char *end;         /* after the object */
+};
+
+static const struct jsonframe jsonpretty = {
+  "\n  {\n    \"url\": ",
+  ",\n    \"parts\": {\n",
+  ",\n",
+  "      \"",
+  "\": ",
+  "\n    }",
+  ",\n    \"params\": [\n",
+  "      {\n        \"key\": ",
+  ",\n        \"value\": ",
+  "\n      }",
+  "\n    ]",
+  "\n  }"
+};
+
+static const struct jsonframe jsoncompact = {
+  "{\"url\":",
+  ",\"parts\":{",
+  ",",
+  "\"",
+  "\":",
+  "}",
+  ",\"params\":[",
+  "{\"key\":",
+  ",\"value\":",
+  "}",
+  "]",
+  "}\n"
+};
+
 static void json(struct option *o, CURLU *uh)
 {
+  const struct jsonframe *f = o->jsonlines ? &jsoncompact : &jsonpretty;
   int i;
   bool first = true;
-  char *url;
-  CURLUcode rc = geturlpart(o, 0, uh, CURLUPART_URL, &url);
-  if(rc) {
-    trurl_cleanup_options(o);
-    verify(o, ERROR_BADURL, "invalid url [%s]", curl_url_strerror(rc));
+  struct outbuf *ob = o->ctx->out;
+  struct urlctx *c = o->ctx;
+  struct urlpart *up = geturlpart(o, 0, uh, CURLUPART_URL);
+  if(up->rc) {
+    verify(o, ERROR_BADURL, "invalid url [%s]", curl_url_strerror(up->rc));
     return;
   }
-  printf("%s\n  {\n    \"url\": ", o->urls ? "," : "");
-  jsonString(stdout, url, strlen(url), false);
-  curl_free(url);
-  fputs(",\n    \"parts\": {\n", stdout);
+  if(!o->jsonlines) {
+#ifdef USE_THREADS
+    if(!o->urls && c->job && !o->unique)
+      /* only the main thread knows if this is the first object */
+      c->job->jsonsep = true;
+#endif
+    if(o->urls)
+      out_char(ob, ',');
+  }
+  out_str(ob, f->url);
+  jsonString(ob, up->value, up->len);
+  out_str(ob, f->parts);
   /* special error handling required to not print params array. */
   bool params_errors = false;
   for(i = 0; variables[i].name; i++) {
-    char *part;
-    /* ask for the URL encoded version so that weird control characters do not
-       cause problems. URL decode it when push to json. */
-    rc = geturlpart(o, VARMODIFIER_URLENCODED, uh, variables[i].part, &part);
-    if(!rc) {
-      int olen;
-      char *dec = NULL;
-
-      if(!o->urlencode) {
-        if(variables[i].part == CURLUPART_QUERY) {
-          /* query parts have '+' for space */
-          char *n;
-          char *p = part;
-          do {
-            n = strchr(p, '+');
-            if(n) {
-              *n = ' ';
-              p = n + 1;
-            }
-          } while(n);
-        }
-
-        dec = curl_easy_unescape(NULL, part, 0, &olen);
-        if(!dec)
-          errorf(o, ERROR_MEM, "out of memory");
-      }
-
+    size_t vlen;
+    CURLUcode rc;
+    const char *value = partvalue(o, uh, &variables[i], &vlen, &rc);
+    if(value) {
       if(!first)
-        fputs(",\n", stdout);
+        out_str(ob, f->sep);
       first = false;
-      printf("      \"%s\": ", variables[i].name);
-      if(dec)
-        jsonString(stdout, dec, (size_t)olen, false);
-      else
-        jsonString(stdout, part, strlen(part), false);
-      curl_free(part);
-      curl_free(dec);
+      out_str(ob, f->name);
+      out_str(ob, variables[i].name);
+      out_str(ob, f->value);
+      jsonString(ob, value, vlen);
     }
     else if(is_valid_trurl_error(rc)) {
         trurl_warnf(o, "%s (%s)", curl_url_strerror(rc), variables[i].name);
         params_errors = true;
     }
   }
-  fputs("\n    }", stdout);
+  out_str(ob, f->partsend);
   first = true;
-  if(nqpairs && !params_errors) {
+  if(c->nqpairs && !params_errors) {
     int j;
-    fputs(",\n    \"params\": [\n", stdout);
-    for(j = 0 ; j < nqpairs; j++) {
-      const char *sep = memchr(qpairsdec[j].str, '=', qpairsdec[j].len);
+    out_str(ob, f->params);
+    for(j = 0 ; j < c->nqpairs; j++) {
+      const struct string *qp = &c->qpairsdec[j];
+      const char *sep = memchr(qp->str, '=', qp->len);
       const char *value = sep ? sep + 1 : "";
-      int value_len = (int) qpairsdec[j].len - (int)(value - qpairsdec[j].str);
+      int value_len = (int) qp->len - (int)(value - qp->str);
       /* don't print out empty/trimmed values */
-      if(!qpairsdec[j].len || !qpairsdec[j].str[0])
+      if(!qp->len || !qp->str[0])
         continue;
       if(!first)
-        fputs(",\n", stdout);
+        out_str(ob, f->sep);
       first = false;
-      fputs("      {\n        \"key\": ", stdout);
-      jsonString(stdout, qpairsdec[j].str,
-                 sep ? (size_t)(sep - qpairsdec[j].str) :
-                       qpairsdec[j].len,
-                 false);
-      fputs(",\n        \"value\": ", stdout);
-      jsonString(stdout, sep?value:"", sep?value_len:0, false);
-      fputs("\n      }", stdout);
+      out_str(ob, f->key);
+      jsonString(ob, qp->str,
+                 sep ? (size_t)(sep - qp->str) : qp->len);
+      out_str(ob, f->keyvalue);
+      jsonString(ob, sep?value:"", sep?value_len:0);
+      out_str(ob, f->paramend);
     }
-    fputs("\n    ]", stdout);
+    out_str(ob, f->paramsend);
   }
-  fputs("\n  }", stdout);
+  out_str(ob, f->end);
 }
 
-/* --trim query="utm_*" */
-static bool trim(struct option *o)
+/* add the URL as a row to the --columnar batch */
+static void columnar(struct option *o, CURLU *uh)
 {
-  bool query_is_modified = false;
-  struct curl_slist *node;
-  for(node = o->trim_list; node; node = node->next) {
-    char *ptr = node->data;
-    if(ptr) {
-      /* 'ptr' should be a fixed string or a pattern ending with an
-         asterisk */
-      size_t inslen;
-      bool pattern = false;
-      int i;
-      char *temp = NULL;
-
-      inslen = strlen(ptr);
-      if(inslen) {
-        pattern = ptr[inslen - 1] == '*';
-        if(pattern && (inslen > 1)) {
-          pattern ^= ptr[inslen - 2] == '\\';
-          if(!pattern) {
-            /* the two final letters are \*, but the backslash needs to be
-               removed. Get a copy and edit that accordingly. */
-            temp = xstrdup(o, ptr);
-            temp[inslen - 2] = '*';
-            temp[inslen - 1] = '\0';
-            ptr = temp;
-            inslen--; /* one byte shorter now */
-          }
-        }
-        if(pattern)
-          inslen--;
-      }
-
-      for(i = 0 ; i < nqpairs; i++) {
-        char *q = qpairs[i].str;
-        char *sep = strchr(q, '=');
-        size_t qlen;
-        if(sep)
-          qlen = sep - q;
-        else
-          qlen = strlen(q);
-
-        if((pattern && (inslen <= qlen) && !casecompare(q, ptr, inslen)) ||
-           (!pattern && (inslen == qlen) && !casecompare(q, ptr, inslen))) {
-          /* this qpair should be stripped out */
-          free(qpairs[i].str);
-          free(qpairsdec[i].str);
-          qpairs[i].str = xstrdup(o, ""); /* marked as deleted */
-          qpairs[i].len = 0;
-          qpairsdec[i].str = xstrdup(o, ""); /* marked as deleted */
-          qpairsdec[i].len = 0;
-          query_is_modified = true;
-        }
-      }
-      free(temp);
+  int i;
+  struct urlctx *c = o->ctx;
+  struct columns *t = &c->cols;
+  struct urlpart *up = geturlpart(o, 0, uh, CURLUPART_URL);
+  bool params_errors = false;
+  if(up->rc) {
+    verify(o, ERROR_BADURL, "invalid url [%s]", curl_url_strerror(up->rc));
+    return;
+  }
+  coladd(o, &t->col[0], up->value, up->len, true);
+  for(i = 0; variables[i].name; i++) {
+    size_t vlen = 0;
+    CURLUcode rc;
+    const char *value = partvalue(o, uh, &variables[i], &vlen, &rc);
+    if(!value && is_valid_trurl_error(rc)) {
+      trurl_warnf(o, "%s (%s)", curl_url_strerror(rc), variables[i].name);
+      params_errors = true;
     }
+    coladd(o, &t->col[i + 1], value ? value : "", vlen, !!value);
   }
-  return query_is_modified;
+  /* the same params as in JSON */
+  for(i = 0; !params_errors && (i < c->nqpairs); i++) {
+    const struct string *qp = &c->qpairsdec[i];
+    const char *sep = memchr(qp->str, '=', qp->len);
+    if(!qp->len || !qp->str[0])
+      continue;
+    if(sep) {
+      coladd(o, &t->col[COL_KEY], qp->str, sep - qp->str, true);
+      coladd(o, &t->col[COL_VALUE], sep + 1, qp->len - (sep - qp->str) - 1,
+             true);
+    }
+    else {
+      coladd(o, &t->col[COL_KEY], qp->str, qp->len, true);
+      coladd(o, &t->col[COL_VALUE], "", 0, false);
+    }
+  }
+  out_u32(&t->params, t->col[COL_KEY].rows);
+  if(t->params.oom)
+    errorf(o, ERROR_MEM, "out of memory");
+
+  if((t->col[0].rows == COLUMNAR_ROWS) || (t->bytes >= COLUMNAR_BYTES) ||
+     o->line_buffered)
+    colflush(o);
 }
 
-static char *decodequery(char *str, size_t len, int *olen)
+/* add a prefix to the trim trie */
+static void trieadd(struct option *o, const char *prefix, size_t len)
 {
-  /* handle '+' to ' ' outside of the libcurl call */
-  char *p = str;
-  size_t plen = len;
-  do {
-    char *n = memchr(p, '+', plen);
-    if(n) {
-      *n = ' ';
-      ++n;
-      plen -= (n - p);
+  struct trimrules *t = &o->trim;
+  int node = 0;
+  size_t i;
+  for(i = 0; i < len; i++) {
+    unsigned char byte = (unsigned char)raw_toupper(prefix[i]);
+    int n;
+    for(n = t->trie[node].child; n; n = t->trie[n].sibling)
+      if(t->trie[n].byte == byte)
+        break;
+    if(!n) {
+      /* there is room for every byte of every prefix */
+      n = t->ntrie++;
+      memset(&t->trie[n], 0, sizeof(struct trienode));
+      t->trie[n].byte = byte;
+      t->trie[n].sibling = t->trie[node].child;
+      t->trie[node].child = n;
     }
-    p = n;
-  } while(p);
-  return curl_easy_unescape(NULL, str, (int)len, olen);
+    node = n;
+  }
+  t->trie[node].end = true;
 }
 
-/* the unusual thing here is that we let '*' remain as-is */
-#define ISURLPUNTCS(x) (((x) == '-') || ((x) == '.') || ((x) == '_') || \
-                        ((x) == '~') || ((x) == '*'))
-#define ISUPPER(x)  (((x) >= 'A') && ((x) <= 'Z'))
-#define ISLOWER(x)  (((x) >= 'a') && ((x) <= 'z'))
-#define ISDIGIT(x)  (((x) >= '0') && ((x) <= '9'))
-#define ISALNUM(x)  (ISDIGIT(x) || ISLOWER(x) || ISUPPER(x))
-#define ISUNRESERVED(x) (ISALNUM(x) || ISURLPUNTCS(x))
-
-static char *encodequery(char *str, size_t len)
+/* Sort the --trim rules into a hash of whole keys and a trie of key
+   prefixes, so that each query pair only needs one lookup in each. */
+static void compiletrim(struct option *o)
 {
-  /* to handle ' ' to '+' escaping we cannot use libcurl's URL encode
-     function */
-  char *dupe = malloc(len * 3 + 1); /* worst case */
-  char *p = dupe;
-  if(!p)
-    return NULL;
+  struct trimrules *t = &o->trim;
+  struct curl_slist *node;
+  size_t bytes = 1;
+  int rules = 0;
 
-  while(len--) {
-    /* treat the characters unsigned */
-    unsigned char in = (unsigned char)*str++;
+  for(node = o->trim_list; node; node = node->next) {
+    bytes += strlen(node->data);
+    rules++;
+  }
+  t->exact = malloc(rules * sizeof(struct string));
+  t->trie = calloc(bytes, sizeof(struct trienode));
+  if(!t->exact || !t->trie || !keyhash_reset(&t->hash, rules))
+    errorf(o, ERROR_MEM, "out of memory");
+  t->ntrie = 1; /* the root */
 
-    if(in == ' ')
-      *dupe++ = '+';
-    else if(ISUNRESERVED(in))
-      *dupe++ = in;
+  for(node = o->trim_list; node; node = node->next) {
+    /* a fixed string or a pattern ending with an asterisk */
+    char *ptr = node->data;
+    size_t inslen = strlen(ptr);
+    bool pattern = false;
+    if(inslen) {
+      pattern = ptr[inslen - 1] == '*';
+      if(pattern && (inslen > 1)) {
+        pattern ^= ptr[inslen - 2] == '\\';
+        if(!pattern) {
+          /* the two final letters are \*, but the backslash needs to be
+             removed */
+          ptr[inslen - 2] = '*';
+          ptr[inslen - 1] = '\0';
+          inslen--; /* one byte shorter now */
+        }
+      }
+      if(pattern)
+        inslen--;
+    }
+    if(pattern)
+      trieadd(o, ptr, inslen);
     else {
-      /* encode it */
-      const char hex[] = "0123456789abcdef";
-      dupe[0]='%';
-      dupe[1] = hex[in>>4];
-      dupe[2] = hex[in & 0xf];
-      dupe += 3;
+      t->exact[t->nexact].str = ptr;
+      t->exact[t->nexact].len = inslen;
+      if(!keyhash_add(&t->hash, t->nexact, hashkey(ptr, inslen, true)))
+        errorf(o, ERROR_MEM, "out of memory");
+      t->nexact++;
     }
   }
-  *dupe = 0;
-  return p;
 }
 
-/* URL decode, then URL encode it back to normalize. But don't touch
-   the first '=' if there is one */
-static struct string *memdupzero(char *source, size_t len, bool *modified)
-{
-  struct string *ret = calloc(1, sizeof(struct string));
-  char *left = NULL;
-  char *right = NULL;
-  char *el = NULL;
-  char *er = NULL;
-  char *encode = NULL;
-  if(!ret)
-    return NULL;
+/* does this key match any --trim rule? */
+static bool trimmatch(const struct trimrules *t, const char *key, size_t klen)
+{
+  int node = 0;
+  size_t i;
+  if(t->nexact) {
+    int e = keyhash_first(&t->hash, hashkey(key, klen, true));
+    for(; e >= 0; e = keyhash_next(&t->hash, e))
+      if((t->exact[e].len == klen) && !casecompare(key, t->exact[e].str, klen))
+        return true;
+  }
+  /* walk the trie as long as there is a prefix of the key in it */
+  for(i = 0; !t->trie[node].end; i++) {
+    unsigned char byte;
+    if(i == klen)
+      return false;
+    byte = (unsigned char)raw_toupper(key[i]);
+    for(node = t->trie[node].child; node; node = t->trie[node].sibling)
+      if(t->trie[node].byte == byte)
+        break;
+    if(!node)
+      return false;
+  }
+  return true;
+}
 
-  if(len) {
-    char *sep = memchr(source, '=', len);
-    int olen;
-    if(!sep) { /* no '=' */
-      char *decode = decodequery(source, (int)len, &olen);
-      if(decode)
-        encode = encodequery(decode, olen);
-      else
-        goto error;
-      curl_free(decode);
+/* --trim query="utm_*" */
+static bool trim(struct option *o)
+{
+  bool query_is_modified = false;
+  struct urlctx *c = o->ctx;
+  int i;
+  if(!o->trim_list)
+    return false;
+
+  for(i = 0 ; i < c->nqpairs; i++) {
+    if(trimmatch(&o->trim, c->qpairs[i].str, qkeylen(&c->qpairs[i]))) {
+      /* this qpair should be stripped out */
+      c->qpairs[i].str = arena_memdup(o, "", 0); /* marked as deleted */
+      c->qpairs[i].len = 0;
+      c->qpairsdec[i] = c->qpairs[i];
+      query_is_modified = true;
     }
-    else {
-      int llen;
-      int rlen;
-      int leftside;
-      int rightside;
-      char *temp;
-
-      /* decode both sides */
-      leftside = (int)(sep - source);
-      if(leftside) {
-        left = decodequery(source, leftside, &llen);
-        if(!left)
-          goto error;
-      }
-      else {
-        left = NULL;
-        llen = 0;
-      }
-
-      /* length on the right side of '=': */
-      rightside = (int)len - (int)(sep - source) - 1;
-
-      if(rightside) {
-        right = decodequery(sep + 1,
-                            (int)len - (int)(sep - source) - 1, &rlen);
-        if(!right)
-          goto error;
-      }
-      else {
-        right = NULL;
-        rlen = 0;
-      }
+  }
+  return query_is_modified;
+}
 
-      /* encode both sides again */
-      if(left) {
-        el = encodequery(left, llen);
-        if(!el)
-          goto error;
-      }
-      if(right) {
-        er = encodequery(right, rlen);
-        if(!er)
-          goto error;
-      }
+/* URL decode, then URL encode it back to normalize. But don't touch
+   the first '=' if there is one */
+static struct string memdupzero(struct option *o, const char *source,
+                                size_t len, bool *modified)
+{
+  struct string ret;
+  const char *sep = memchr(source, '=', len);
+  char *out = arena_alloc(o, len * 3 + 1); /* worst case */
+  size_t olen;
 
-      temp = curl_maprintf("%s=%s", el ? el : "", er ? er : "");
-      if(!temp)
-        goto error;
-      /* pointers from curl_maprintf() must be curl_free()d so make a copy */
-      encode = strdup(temp);
-      curl_free(temp);
-      if(!encode)
-        goto error;
-    }
-    olen = (int)strlen(encode);
-
-    if(((size_t)olen != len) || strcmp(encode, source))
-      *modified |= true;
-    ret->str = encode;
-    ret->len = olen;
-  }
-  curl_free(left);
-  curl_free(right);
-  free(el);
-  free(er);
+  if(sep) {
+    olen = normquery(out, source, sep - source);
+    out[olen++] = '=';
+    olen += normquery(&out[olen], sep + 1, len - (sep - source) - 1);
+  }
+  else
+    olen = normquery(out, source, len);
+  out[olen] = 0;
+
+  /* a '+' is a modification since it was decoded into a space */
+  if((olen != len) || memcmp(out, source, len) || memchr(source, '+', len))
+    *modified = true;
+  ret.str = out;
+  ret.len = olen;
   return ret;
-error:
-  curl_free(left);
-  curl_free(right);
-  free(el);
-  free(er);
-  free(encode);
-  free(ret);
-  return NULL;
 }
 
-/* URL decode the pair and return it in an allocated chunk */
-static struct string *memdupdec(char *source, size_t len, bool json)
+/* URL decode the pair and return it in the arena */
+static struct string memdupdec(struct option *o, const char *source,
+                               size_t len)
 {
-  char *sep = memchr(source, '=', len);
-  char *left = NULL;
-  char *right = NULL;
-  int right_len = 0;
-  int left_len = 0;
-  char *str;
-  struct string *ret;
-  left = strurldecode(source, (int)(sep ? (size_t)(sep - source) : len),
-                      &left_len);
+  struct string ret;
+  const char *sep = memchr(source, '=', len);
+  char *out = arena_alloc(o, len + 1);
+  size_t olen;
+
   if(sep) {
-    char *p;
-    int plen;
-    right = strurldecode(sep + 1, (int)(len - (sep - source) - 1),
-                         &right_len);
-
-    /* convert null bytes to periods */
-    for(plen = right_len, p = right; plen; plen--, p++) {
-      if(!*p && !json) {
-        *p = REPLACE_NULL_BYTE;
-      }
+    char *right;
+    size_t rlen;
+    olen = urldecode(out, source, sep - source, true);
+    out[olen++] = '=';
+    right = &out[olen];
+    rlen = urldecode(right, sep + 1, len - (sep - source) - 1, true);
+    if(!o->jsonout && !o->columnar) {
+      /* convert null bytes to periods */
+      size_t i;
+      for(i = 0; i < rlen; i++)
+        if(!right[i])
+          right[i] = REPLACE_NULL_BYTE;
     }
+    olen += rlen;
   }
-  str = malloc(sizeof(char) * (left_len + (sep?(right_len + 1):0)));
-  if(!str) {
-    curl_free(right);
-    curl_free(left);
-    return NULL;
-  }
-  memcpy(str, left, left_len);
-  if(sep) {
-    str[left_len] = '=';
-    memcpy(str + 1 + left_len, right, right_len);
-  }
-  curl_free(right);
-  curl_free(left);
-  ret = malloc(sizeof(struct string));
-  if(!ret) {
-    free(str);
-    return NULL;
-  }
-  ret->str = str;
-  ret->len = left_len + (sep?(right_len + 1):0);
+  else
+    olen = urldecode(out, source, len, true);
+  out[olen] = 0;
+
+  ret.str = out;
+  ret.len = olen;
   return ret;
 }
 
 
-static void freeqpairs(void)
+/* forget the stored pairs, but keep the vectors for the next URL */
+static void freeqpairs(struct urlctx *c)
 {
-  int i;
-  for(i = 0; i<nqpairs; i++) {
-    if(qpairs[i].len) {
-      free(qpairs[i].str);
-      qpairs[i].str = NULL;
-      free(qpairsdec[i].str);
-      qpairsdec[i].str = NULL;
-    }
+  c->nqpairs = 0;
+  c->qindexed[0] = c->qindexed[1] = false;
+}
+
+static void urlset_free(struct urlset *u)
+{
+  free(u->fp);
+  free(u->text);
+  free(u->texts);
+  memset(u, 0, sizeof(*u));
+}
+
+static void counter_free(struct counter *t)
+{
+  free(t->e);
+  free(t->keys);
+  out_free(&t->line);
+  memset(t, 0, sizeof(*t));
+}
+
+/* forget everything about the URL lap that just finished */
+static void urlctx_reset(struct urlctx *c)
+{
+  freeqpairs(c);
+  clearparts(c);
+  arena_reset(&c->arena);
+}
+
+static void urlctx_cleanup(struct urlctx *c)
+{
+  urlctx_reset(c);
+  free(c->parts);
+  c->parts = NULL;
+  c->maxparts = 0;
+  free(c->qpairs);
+  free(c->qpairsdec);
+  free(c->sortkeys);
+  c->qpairs = c->qpairsdec = NULL;
+  c->sortkeys = NULL;
+  c->maxsortkeys = 0;
+  c->maxqpairs = 0;
+  keyhash_free(&c->qindex[0]);
+  keyhash_free(&c->qindex[1]);
+  colfree(&c->cols);
+  arena_free(&c->arena);
+  curl_url_cleanup(c->uh);
+  c->uh = NULL;
+  free(c->stats);
+  c->stats = NULL;
+  urlset_free(&c->seen);
+  counter_free(&c->counts);
+}
+
+/* make room for one more query pair */
+static void growqpairs(struct option *o)
+{
+  struct urlctx *c = o->ctx;
+  if(c->nqpairs == c->maxqpairs) {
+    int max = c->maxqpairs ? c->maxqpairs * 2 : MIN_QPAIRS;
+    struct string *n = realloc(c->qpairs, max * sizeof(struct string));
+    if(!n)
+      errorf(o, ERROR_MEM, "out of memory");
+    c->qpairs = n;
+    n = realloc(c->qpairsdec, max * sizeof(struct string));
+    if(!n)
+      errorf(o, ERROR_MEM, "out of memory");
+    c->qpairsdec = n;
+    c->maxqpairs = max;
   }
-  nqpairs = 0;
 }
 
 /* store the pair both encoded and decoded, return if modified */
-static bool addqpair(char *pair, size_t len, bool json)
+static bool addqpair(struct option *o, const char *pair, size_t len)
 {
-  struct string *p = NULL;
-  struct string *pdec = NULL;
+  struct urlctx *c = o->ctx;
   bool modified = false;
-  if(nqpairs < MAX_QPAIRS) {
-    p = memdupzero(pair, len, &modified);
-    pdec = memdupdec(pair, len, json);
-    if(p && pdec) {
-      qpairs[nqpairs].str = p->str;
-      qpairs[nqpairs].len = p->len;
-      qpairsdec[nqpairs].str = pdec->str;
-      qpairsdec[nqpairs].len = pdec->len;
-      nqpairs++;
-    }
+  int i;
+  growqpairs(o);
+  c->qpairs[c->nqpairs] = memdupzero(o, pair, len, &modified);
+  c->qpairsdec[c->nqpairs] = memdupdec(o, pair, len);
+  /* keep existing indexes up to date */
+  for(i = 0; i < 2; i++) {
+    const struct string *qp = i ? &c->qpairsdec[c->nqpairs] :
+      &c->qpairs[c->nqpairs];
+    if(c->qindexed[i] &&
+       !keyhash_add(&c->qindex[i], c->nqpairs,
+                    hashkey(qp->str, qkeylen(qp), false)))
+      errorf(o, ERROR_MEM, "out of memory");
   }
-  else
-    warnf("too many query pairs");
-
-  if(pdec)
-    free(pdec);
-  if(p)
-    free(p);
+  c->nqpairs++;
   return modified;
 }
 
 /* convert the query string into an array of name=data pair */
 static bool extractqpairs(CURLU *uh, struct option *o)
 {
+  struct fasturl *f = &o->ctx->fast;
   char *q = NULL;
+  const char *p = NULL;
   bool modified = false;
-  memset(qpairs, 0, sizeof(qpairs));
-  nqpairs = 0;
+  freeqpairs(o->ctx);
   /* extract the query */
-  if(!curl_url_get(uh, CURLUPART_QUERY, &q, 0)) {
-    char *p = q;
-    char *amp;
+  if(f->active)
+    p = f->query;
+  else if(!curl_url_get(uh, CURLUPART_QUERY, &q, 0))
+    p = q;
+  if(p) {
+    const char *amp;
     while(*p) {
       size_t len;
       amp = strchr(p, o->qsep[0]);
@@ -1562,7 +3462,10 @@ static bool extractqpairs(CURLU *uh, struct option *o)
         len = strlen(p);
       else
         len = amp - p;
-      modified |= addqpair(p, len, o->jsonout);
+      modified |= addqpair(o, p, len);
+      if(amp && len)
+        /* rebuild queries with multiple pairs, to drop empty ones */
+        modified = true;
       if(amp)
         p = amp + 1;
       else
@@ -1576,54 +3479,152 @@ static bool extractqpairs(CURLU *uh, struct option *o)
 static void qpair2query(CURLU *uh, struct option *o)
 {
   int i;
-  char *nq = NULL;
-  for(i = 0; i<nqpairs; i++) {
-    char *oldnq = nq;
-    nq = curl_maprintf("%s%s%s", nq ? nq : "",
-                       (nq && *nq && qpairs[i].len) ? o->qsep : "",
-                       qpairs[i].len ? qpairs[i].str : "");
-    curl_free(oldnq);
+  char *nq;
+  char *p;
+  size_t size = 1;
+  struct urlctx *c = o->ctx;
+  if(!c->nqpairs)
+    return;
+
+  /* room for all pairs and separators */
+  for(i = 0; i<c->nqpairs; i++)
+    size += c->qpairs[i].len + 1;
+  nq = p = arena_alloc(o, size);
+
+  for(i = 0; i<c->nqpairs; i++) {
+    if(!c->qpairs[i].len)
+      continue;
+    if(p != nq)
+      *p++ = o->qsep[0];
+    memcpy(p, c->qpairs[i].str, c->qpairs[i].len);
+    p += c->qpairs[i].len;
   }
-  if(nq) {
-    int rc = curl_url_set(uh, CURLUPART_QUERY, nq, 0);
-    if(rc)
-      trurl_warnf(o, "internal problem: failed to store updated query in URL");
+  *p = 0;
+
+  if(c->fast.active && *nq) {
+    c->fast.query = nq;
+    c->fast.querylen = p - nq;
+    c->fast.newquery = true;
+    return;
   }
-  curl_free(nq);
+  if(c->fast.active)
+    fastfallback(o, uh);
+  if(curl_url_set(uh, CURLUPART_QUERY, nq, 0))
+    trurl_warnf(o, "internal problem: failed to store updated query in URL");
 }
 
-/* sort case insensitively */
-static int cmpfunc(const void *p1, const void *p2)
-{
-  int i;
-  int len = (int)((((struct string *)p1)->len) < (((struct string *)p2)->len)?
-                  (((struct string *)p1)->len) : (((struct string *)p2)->len));
+#define SORTKEY_BYTES 8 /* bytes packed into a sort key */
+#define SORT_INSERTION 16 /* insertion sort up to this many pairs */
 
-  for(i = 0; i < len; i++) {
-    char c1 = ((struct string *)p1)->str[i] | ('a' - 'A');
-    char c2 = ((struct string *)p2)->str[i] | ('a' - 'A');
-    if(c1 != c2)
-      return c1 - c2;
+/* Case insensitive as ('a' - 'A') is or'ed into every byte and the bytes
+   compare as signed chars. Flipping the top bit turns that order into the
+   unsigned one the packed prefixes are compared in. */
+#define SORTFOLD(x) ((unsigned char)(((x) | ('a' - 'A')) ^ 0x80))
+
+/* Compare the pairs for --sort-query. A pair that is a prefix of the other
+   comes first, pairs that only differ in case keep their order. */
+static int cmpsortkey(const struct sortkey *k1, const struct sortkey *k2)
+{
+  size_t len = (k1->pair->len < k2->pair->len) ?
+    k1->pair->len : k2->pair->len;
+  size_t i;
+  if(len < SORTKEY_BYTES) {
+    /* only the first 'len' bytes count */
+    unsigned int shift = (unsigned int)(SORTKEY_BYTES - len) * 8;
+    uint64_t p1 = len ? k1->prefix >> shift : 0;
+    uint64_t p2 = len ? k2->prefix >> shift : 0;
+    if(p1 != p2)
+      return (p1 < p2) ? -1 : 1;
   }
+  else if(k1->prefix != k2->prefix)
+    return (k1->prefix < k2->prefix) ? -1 : 1;
+  else {
+    for(i = SORTKEY_BYTES; i < len; i++) {
+      unsigned char c1 = SORTFOLD(k1->pair->str[i]);
+      unsigned char c2 = SORTFOLD(k2->pair->str[i]);
+      if(c1 != c2)
+        return c1 - c2;
+    }
+  }
+  if(k1->pair->len != k2->pair->len)
+    return (k1->pair->len < k2->pair->len) ? -1 : 1;
+  return k1->index - k2->index;
+}
 
-  return 0;
+static int cmpsortkeys(const void *p1, const void *p2)
+{
+  return cmpsortkey(p1, p2);
 }
 
+/* Sort the pairs on their encoded version, then put the decoded ones in the
+   same order */
 static bool sortquery(struct option *o)
 {
-  if(o->sort_query) {
-    /* not these two lists may no longer be the same order after the sort */
-    qsort(&qpairs[0], nqpairs, sizeof(struct string), cmpfunc);
-    qsort(&qpairsdec[0], nqpairs, sizeof(struct string), cmpfunc);
-    return true;
+  struct urlctx *c = o->ctx;
+  struct sortkey *keys = c->sortkeys;
+  int n = c->nqpairs;
+  int i;
+  if(!o->sort_query)
+    return false;
+  if(n > c->maxsortkeys) {
+    keys = realloc(c->sortkeys, c->maxqpairs * sizeof(struct sortkey));
+    if(!keys)
+      errorf(o, ERROR_MEM, "out of memory");
+    c->sortkeys = keys;
+    c->maxsortkeys = c->maxqpairs;
   }
-  return false;
+
+  for(i = 0; i < n; i++) {
+    const struct string *qp = &c->qpairs[i];
+    uint64_t prefix = 0;
+    size_t j;
+    for(j = 0; j < SORTKEY_BYTES; j++)
+      prefix = (prefix << 8) | (j < qp->len ? SORTFOLD(qp->str[j]) : 0);
+    keys[i].prefix = prefix;
+    keys[i].pair = qp;
+    keys[i].index = i;
+  }
+  if(n <= SORT_INSERTION) {
+    for(i = 1; i < n; i++) {
+      struct sortkey k = keys[i];
+      int j;
+      for(j = i; (j > 0) && (cmpsortkey(&k, &keys[j - 1]) < 0); j--)
+        keys[j] = keys[j - 1];
+      keys[j] = k;
+    }
+  }
+  else
+    qsort(keys, n, sizeof(struct sortkey), cmpsortkeys);
+
+  /* move pair keys[i].index to i, one cycle of the permutation at a time */
+  for(i = 0; i < n; i++) {
+    struct string enc;
+    struct string dec;
+    int j = i;
+    if(keys[i].index < 0)
+      continue;
+    enc = c->qpairs[i];
+    dec = c->qpairsdec[i];
+    while(keys[j].index != i) {
+      int from = keys[j].index;
+      c->qpairs[j] = c->qpairs[from];
+      c->qpairsdec[j] = c->qpairsdec[from];
+      keys[j].index = -1;
+      j = from;
+    }
+    c->qpairs[j] = enc;
+    c->qpairsdec[j] = dec;
+    keys[j].index = -1;
+  }
+  c->qindexed[0] = c->qindexed[1] = false;
+  return true;
 }
 
 static bool replace(struct option *o)
 {
   bool query_is_modified = false;
   struct curl_slist *node;
+  struct urlctx *c = o->ctx;
   for(node = o->replace_list; node; node = node->next) {
     struct string key;
     struct string value;
@@ -1640,104 +3641,50 @@ static bool replace(struct option *o)
       value.str = NULL;
       value.len = 0;
     }
-    for(i = 0; i < nqpairs; i++) {
-      char *q = qpairs[i].str;
-      /* not the correct query, move on */
-      if(strncmp(q, key.str, key.len))
+    for(i = 0; i < c->nqpairs; i++) {
+      /* not the correct query, move on. Keys starting with it match so
+         the index cannot be used. */
+      if(!c->qpairs[i].len || strncmp(c->qpairs[i].str, key.str, key.len))
         continue;
-      free(qpairs[i].str);
-      free(qpairsdec[i].str);
       /* this is a duplicate remove it. */
       if(replaced) {
-        qpairs[i].len = 0;
-        qpairs[i].str = xstrdup(o, "");
-        qpairsdec[i].len = 0;
-        qpairsdec[i].str = xstrdup(o, "");
+        c->qpairs[i].len = 0;
+        c->qpairs[i].str = arena_memdup(o, "", 0);
+        c->qpairsdec[i] = c->qpairs[i];
         continue;
       }
-      struct string *pdec =
-        memdupdec(key.str, key.len + value.len + 1, o->jsonout);
-      struct string *p = memdupzero(key.str, key.len + value.len +
-                                    (value.str ? 1 : 0),
-                                    &query_is_modified);
-      qpairs[i].len = p->len;
-      qpairs[i].str = p->str;
-      qpairsdec[i].len = pdec->len;
-      qpairsdec[i].str = pdec->str;
-      free(pdec);
-      free(p);
+      c->qpairsdec[i] = memdupdec(o, key.str, key.len + value.len + 1);
+      c->qpairs[i] = memdupzero(o, key.str, key.len + value.len +
+                                (value.str ? 1 : 0),
+                                &query_is_modified);
       query_is_modified = replaced = true;
     }
+    /* replaced pairs may have new keys */
+    if(replaced)
+      c->qindexed[0] = c->qindexed[1] = false;
 
     if(!replaced && o->force_replace) {
-      addqpair(key.str, strlen(key.str), o->jsonout);
+      addqpair(o, key.str, strlen(key.str));
       query_is_modified = true;
     }
   }
   return query_is_modified;
 }
 
-static CURLUcode seturl(struct option *o, CURLU *uh, const char *url)
-{
-  return curl_url_set(uh, CURLUPART_URL, url,
-                      (o->no_guess_scheme ?
-                       0 : CURLU_GUESS_SCHEME)|
-                      (o->curl ? 0 : CURLU_NON_SUPPORT_SCHEME)|
-                      (o->accept_space ?
-                       CURLU_ALLOW_SPACE : 0)|
-                      CURLU_URLENCODE);
-}
-
-static char *canonical_path(const char *path)
+/* Returns the path with each segment URL decoded and encoded again, or NULL
+   if that does not change it. */
+static char *canonical_path(struct option *o, const char *path)
 {
-  /* split the path per slash, URL decode + encode, then put together again */
   size_t len = strlen(path);
-  char *sl;
-  char *dupe = NULL;
-
-  do {
-    char *opath;
-    char *npath;
-    char *ndupe;
-    int olen;
-    sl = memchr(path, '/', len);
-    size_t partlen = sl ? (size_t)(sl - path) : len;
-
-    if(partlen) {
-      /* First URL decode the part */
-      opath = curl_easy_unescape(NULL, path, (int)partlen, &olen);
-      if(!opath)
-        return NULL;
-
-      /* Then URL encode it again */
-      npath = curl_easy_escape(NULL, opath, olen);
-      curl_free(opath);
-      if(!npath)
-        return NULL;
-
-      ndupe = curl_maprintf("%s%s%s", dupe ? dupe : "", npath, sl ? "/": "");
-      curl_free(npath);
-    }
-    else if(sl) {
-      /* zero length part but a slash */
-      ndupe = curl_maprintf("%s/", dupe ? dupe : "");
-    }
-    else {
-      /* no part, no slash */
-      break;
-    }
-    curl_free(dupe);
-    if(!ndupe)
-      return NULL;
-
-    dupe = ndupe;
-    if(sl) {
-      path = sl + 1;
-      len -= partlen + 1;
-    }
-
-  } while(sl);
+  char *dupe;
+  size_t olen;
+  if(urlcanonical(path, len, '/'))
+    return NULL;
 
+  /* re-encoding makes it at most three times longer */
+  dupe = arena_alloc(o, len * 3 + 1);
+  olen = urlnormalize(dupe, path, len, '/');
+  dupe[olen] = 0;
   return dupe;
 }
 
@@ -1750,141 +3697,375 @@ static void normalize_part(struct option *o, CURLU *uh, CURLUPart part)
   if(ptr)
     ptrlen = strlen(ptr);
 
-  if(ptrlen) {
-    int olen;
-    char *uptr;
-    /* First URL decode the component */
-    char *rawptr = curl_easy_unescape(NULL, ptr, (int)ptrlen, &olen);
-    if(!rawptr)
-      errorf(o, ERROR_MEM, "out of memory");
+  if(ptrlen && !urlcanonical(ptr, ptrlen, 0)) {
+    /* URL decode and encode it again, store the updated one */
+    char *uptr = arena_alloc(o, ptrlen * 3 + 1);
+    size_t olen = urlnormalize(uptr, ptr, ptrlen, 0);
+    uptr[olen] = 0;
+    (void)curl_url_set(uh, part, uptr, 0);
+  }
+  curl_free(ptr);
+}
 
-    /* Then URL encode it again */
-    uptr = curl_easy_escape(NULL, rawptr, olen);
-    curl_free(rawptr);
-    if(!uptr)
-      errorf(o, ERROR_MEM, "out of memory");
 
-    if(strcmp(ptr, uptr))
-      /* changed, store the updated one */
-      (void)curl_url_set(uh, part, uptr, 0);
-    curl_free(uptr);
+/* set item 'i' of an --iterate list */
+static void iterset(struct option *o, CURLU *uh, const struct iterlist *it,
+                    size_t i)
+{
+  (void)setpart(uh, o, it->v, it->items[i], it->urlencode);
+}
+
+static void output(struct option *o, CURLU *uh)
+{
+  struct outbuf *ob = o->ctx->out;
+  if(o->jsonout)
+    json(o, uh);
+  else if(o->columnar)
+    columnar(o, uh);
+  else if(o->format) {
+    /* custom output format */
+    get(o, uh);
   }
-  curl_free(ptr);
+  else {
+    /* default output is full URL */
+    struct urlpart *up = geturlpart(o, 0, uh, CURLUPART_URL);
+    if(!up->rc) {
+      out_write(ob, up->value, up->len);
+      out_char(ob, '\n');
+    }
+  }
+}
+
+/* a 64-bit hash of the data, never zero */
+static uint64_t fingerprint(const char *data, size_t len)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+  uint64_t v;
+  while(len >= 8) {
+    memcpy(&v, data, 8);
+    h = (h ^ v) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+    data += 8;
+    len -= 8;
+  }
+  v = 0;
+  memcpy(&v, data, len);
+  h = (h ^ v) * 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 29;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 32;
+  return h ? h : 1;
 }
 
+static bool urlset_grow(struct urlset *u, bool exact)
+{
+  size_t slots = u->fp ? (u->mask + 1) * 2 : 1024;
+  uint64_t *fp = calloc(slots, sizeof(uint64_t));
+  size_t *text = exact ? malloc(slots * sizeof(size_t)) : NULL;
+  size_t i;
+  if(!fp || (exact && !text)) {
+    free(fp);
+    free(text);
+    return false;
+  }
+  for(i = 0; u->fp && (i <= u->mask); i++) {
+    if(u->fp[i]) {
+      size_t n = u->fp[i] & (slots - 1);
+      while(fp[n])
+        n = (n + 1) & (slots - 1);
+      fp[n] = u->fp[i];
+      if(exact)
+        text[n] = u->text[i];
+    }
+  }
+  free(u->fp);
+  free(u->text);
+  u->fp = fp;
+  u->text = text;
+  u->mask = slots - 1;
+  return true;
+}
 
-static void singleurl(struct option *o,
-                      const char *url, /* might be NULL */
-                      struct iterinfo *iinfo,
-                      struct curl_slist *iter)
+/* Adds the output to the seen ones. Returns false if it was seen before */
+static bool urlset_add(struct option *o, struct urlset *u, uint64_t fp,
+                       const char *data, size_t len)
 {
-  CURLU *uh = iinfo->uh;
-  bool first_lap = true;
-  if(!uh) {
-    uh = curl_url();
-    if(!uh)
+  size_t n;
+  if(o->unique_max && (u->count >= o->unique_max)) {
+    /* start over */
+    memset(u->fp, 0, (u->mask + 1) * sizeof(uint64_t));
+    u->count = u->tlen = 0;
+  }
+  if((!u->fp || ((u->count + 1) * 2 > u->mask + 1)) &&
+     !urlset_grow(u, o->unique_exact))
+    errorf(o, ERROR_MEM, "out of memory");
+  for(n = fp & u->mask; u->fp[n]; n = (n + 1) & u->mask) {
+    if(u->fp[n] == fp) {
+      size_t tlen;
+      if(!o->unique_exact)
+        return false;
+      memcpy(&tlen, &u->texts[u->text[n]], sizeof(size_t));
+      if((tlen == len) &&
+         !memcmp(&u->texts[u->text[n] + sizeof(size_t)], data, len))
+        return false;
+    }
+  }
+  if(o->unique_exact) {
+    if(u->tsize - u->tlen < len + sizeof(size_t)) {
+      size_t size = u->tsize ? u->tsize : 65536;
+      char *t;
+      while(size - u->tlen < len + sizeof(size_t))
+        size *= 2;
+      t = realloc(u->texts, size);
+      if(!t)
+        errorf(o, ERROR_MEM, "out of memory");
+      u->texts = t;
+      u->tsize = size;
+    }
+    u->text[n] = u->tlen;
+    memcpy(&u->texts[u->tlen], &len, sizeof(size_t));
+    memcpy(&u->texts[u->tlen + sizeof(size_t)], data, len);
+    u->tlen += len + sizeof(size_t);
+  }
+  u->fp[n] = fp;
+  u->count++;
+  return true;
+}
+
+/* not counting the comma that separates JSON objects */
+static const char *recordbody(const struct option *o, const char *data,
+                              size_t *lenp)
+{
+  if(o->jsonout && !o->jsonlines && *lenp && (data[0] == ',')) {
+    (*lenp)--;
+    return data + 1;
+  }
+  return data;
+}
+
+/* --unique: show the output of this URL unless it was shown before.
+   Returns true if it was shown, or is left for the main thread to
+   decide. */
+static bool uniqueoutput(struct option *o, CURLU *uh)
+{
+  struct urlctx *c = o->ctx;
+  struct outbuf *ob = c->out;
+  const char *data;
+  size_t len;
+  if(o->columnar) {
+    /* the columns all come from the URL */
+    struct urlpart *up = geturlpart(o, 0, uh, CURLUPART_URL);
+    if(up->rc)
+      return true;
+    len = up->len;
+    if(!urlset_add(o, &c->seen, fingerprint(up->value, len), up->value, len))
+      return false;
+    columnar(o, uh);
+    return true;
+  }
+  out_hold(ob);
+  output(o, uh);
+  if(!ob->held)
+    /* flushed on the way, it cannot be taken back */
+    return true;
+  ob->held = false;
+  len = ob->len - ob->mark;
+  data = recordbody(o, &ob->buf[ob->mark], &len);
+  if(c->pooled) {
+    struct job *job = c->job;
+    if(job->nrecs == job->maxrecs) {
+      size_t max = job->maxrecs ? job->maxrecs * 2 : 256;
+      struct record *n = realloc(job->recs, max * sizeof(struct record));
+      if(!n)
+        errorf(o, ERROR_MEM, "out of memory");
+      job->recs = n;
+      job->maxrecs = max;
+    }
+    job->recs[job->nrecs].len = ob->len - ob->mark;
+    job->recs[job->nrecs].fp = fingerprint(data, len);
+    job->nrecs++;
+    return true;
+  }
+  if(urlset_add(o, &c->seen, fingerprint(data, len), data, len))
+    return true;
+  ob->len = ob->mark;
+  return false;
+}
+
+static void counter_grow(struct option *o, struct counter *t)
+{
+  size_t slots = t->e ? (t->mask + 1) * 2 : 1024;
+  struct countentry *e = calloc(slots, sizeof(struct countentry));
+  size_t i;
+  if(!e)
+    errorf(o, ERROR_MEM, "out of memory");
+  for(i = 0; t->e && (i <= t->mask); i++) {
+    if(t->e[i].count) {
+      size_t n = t->e[i].hash & (slots - 1);
+      while(e[n].count)
+        n = (n + 1) & (slots - 1);
+      e[n] = t->e[i];
+    }
+  }
+  free(t->e);
+  t->e = e;
+  t->mask = slots - 1;
+}
+
+/* add 'count' to the count of the key */
+static void counter_add(struct option *o, struct counter *t,
+                        const char *key, size_t len, uint64_t count)
+{
+  uint64_t h = fingerprint(key, len);
+  size_t n;
+  if(!t->e || ((t->used + 1) * 2 > t->mask + 1))
+    counter_grow(o, t);
+  for(n = h & t->mask; t->e[n].count; n = (n + 1) & t->mask) {
+    struct countentry *e = &t->e[n];
+    if((e->hash == h) && (e->len == len) &&
+       !memcmp(&t->keys[e->key], key, len)) {
+      e->count += count;
+      return;
+    }
+  }
+  if(t->ksize - t->klen < len) {
+    size_t size = t->ksize ? t->ksize : 65536;
+    char *k;
+    while(size - t->klen < len)
+      size *= 2;
+    k = realloc(t->keys, size);
+    if(!k)
       errorf(o, ERROR_MEM, "out of memory");
-    if(url) {
-      CURLUcode rc = seturl(o, uh, url);
-      if(rc) {
-        curl_url_cleanup(uh);
-        verify(o, ERROR_BADURL, "%s [%s]", curl_url_strerror(rc), url);
-        return;
-      }
-      if(o->redirect) {
-        rc = seturl(o, uh, o->redirect);
-        if(rc) {
-          curl_url_cleanup(uh);
-          verify(o, ERROR_BADURL, "invalid redirection: %s [%s]",
-                 curl_url_strerror(rc), o->redirect);
-          return;
-        }
-      }
+    t->keys = k;
+    t->ksize = size;
+  }
+  memcpy(&t->keys[t->klen], key, len);
+  t->e[n].hash = h;
+  t->e[n].count = count;
+  t->e[n].key = t->klen;
+  t->e[n].len = len;
+  t->klen += len;
+  t->used++;
+}
+
+#ifdef USE_THREADS
+static void counter_merge(struct option *o, struct counter *to,
+                          const struct counter *from)
+{
+  size_t i;
+  for(i = 0; from->e && (i <= from->mask); i++) {
+    const struct countentry *e = &from->e[i];
+    if(e->count)
+      counter_add(o, to, &from->keys[e->key], e->len, e->count);
+  }
+}
+#endif
+
+/* --count the output of the format, or --count-keys the query keys */
+static void countoutput(struct option *o, CURLU *uh)
+{
+  struct urlctx *c = o->ctx;
+  struct counter *t = &c->counts;
+  if(o->count_keys) {
+    int i;
+    for(i = 0; i < c->nqpairs; i++) {
+      const struct string *q = &c->qpairsdec[i];
+      const char *eq;
+      if(!q->len)
+        continue;
+      eq = memchr(q->str, '=', q->len);
+      counter_add(o, t, q->str, eq ? (size_t)(eq - q->str) : q->len, 1);
     }
   }
-  do {
-    struct curl_slist *p;
-    bool url_is_invalid = false;
-    bool query_is_modified = false;
-    unsigned setmask = 0;
-
-    /* set everything */
-    setmask = set(uh, o);
-
-    if(iter) {
-      char iterbuf[1024];
-      /* "part=item1 item2 item2" */
-      const char *part;
-      size_t plen;
-      const char *w;
-      size_t wlen;
-      char *sep;
-      bool urlencode = true;
-      const struct var *v;
-
-      if(!iinfo->ptr) {
-        part = iter->data;
-        sep = strchr(part, '=');
-        if(!sep)
-          errorf(o, ERROR_ITER, "wrong iterate syntax");
-        plen = sep - part;
-        if(sep[-1] == ':') {
-          urlencode = false;
-          plen--;
-        }
-        w = sep + 1;
-        /* store for next lap */
-        iinfo->part = part;
-        iinfo->plen = plen;
-        v = comp2var(part, plen);
-        if(!v) {
-          curl_url_cleanup(uh);
-          errorf(o, ERROR_ITER, "bad component for iterate");
-        }
-        if(iinfo->varmask & (1<<v->part)) {
-          curl_url_cleanup(uh);
-          errorf(o, ERROR_ITER,
-                       "duplicate component for iterate: %s", v->name);
-        }
-        if(setmask & (1 << v->part)) {
-          curl_url_cleanup(uh);
-          errorf(o, ERROR_ITER,
-                 "duplicate --iterate and --set for component %s",
-                 v->name);
-        }
-      }
-      else {
-        part = iinfo->part;
-        plen = iinfo->plen;
-        v = comp2var(part, plen);
-        w = iinfo->ptr;
-      }
+  else {
+    struct outbuf *out = c->out;
+    size_t len;
+    t->line.len = 0;
+    c->out = &t->line;
+    get(o, uh);
+    c->out = out;
+    if(t->line.oom)
+      errorf(o, ERROR_MEM, "out of memory");
+    len = t->line.len;
+    if(len && (t->line.buf[len - 1] == '\n'))
+      len--;
+    counter_add(o, t, t->line.buf, len, 1);
+  }
+}
 
-      sep = strchr(w, ' ');
-      if(sep) {
-        wlen = sep - w;
-        iinfo->ptr = sep + 1; /* next word is here */
-      }
-      else {
-        /* last word */
-        wlen = strlen(w);
-        iinfo->ptr = NULL;
-      }
-      (void)curl_msnprintf(iterbuf, sizeof(iterbuf),
-                           "%.*s%s=%.*s", (int)plen, part,
-                           urlencode ? "" : ":",
-                           (int)wlen, w);
-      setone(uh, iterbuf, o);
-      if(iter->next) {
-        struct iterinfo info;
-        memset(&info, 0, sizeof(info));
-        info.uh = uh;
-        info.varmask = iinfo->varmask | (1 << v->part);
-        singleurl(o, url, &info, iter->next);
-      }
+struct countrow {
+  const char *key;
+  size_t len;
+  uint64_t count;
+};
+
+/* the largest count first, the same counts by key */
+static int cmpcount(const void *p1, const void *p2)
+{
+  const struct countrow *r1 = p1;
+  const struct countrow *r2 = p2;
+  int rc;
+  if(r1->count != r2->count)
+    return (r1->count < r2->count) ? 1 : -1;
+  rc = memcmp(r1->key, r2->key, (r1->len < r2->len) ? r1->len : r2->len);
+  if(rc)
+    return rc;
+  return (r1->len < r2->len) ? -1 : (r1->len > r2->len);
+}
+
+/* show the counts, one "[count]<tab>[key]" per line */
+static void showcounts(struct option *o, struct outbuf *ob)
+{
+  struct counter *t = &o->ctx->counts;
+  struct countrow *rows;
+  size_t n = 0;
+  size_t i;
+  if(!o->count && !o->count_keys)
+    return;
+  rows = malloc((t->used ? t->used : 1) * sizeof(struct countrow));
+  if(!rows)
+    errorf(o, ERROR_MEM, "out of memory");
+  for(i = 0; t->e && (i <= t->mask); i++) {
+    if(t->e[i].count) {
+      rows[n].key = &t->keys[t->e[i].key];
+      rows[n].len = t->e[i].len;
+      rows[n].count = t->e[i].count;
+      n++;
     }
+  }
+  qsort(rows, n, sizeof(struct countrow), cmpcount);
+  if(o->count_top && (o->count_top < n))
+    n = o->count_top;
+  for(i = 0; i < n; i++) {
+    char num[32];
+    curl_msnprintf(num, sizeof(num), "%" CURL_FORMAT_CURL_OFF_TU "\t",
+                   (curl_off_t)rows[i].count);
+    out_str(ob, num);
+    out_write(ob, rows[i].key, rows[i].len);
+    out_char(ob, '\n');
+  }
+  free(rows);
+  counter_free(t);
+}
 
-    if(first_lap) {
+/* Work on the URL in 'uh' as it is now with the components in 'changed'
+   set since the previous output, and show it */
+static void oneurl(struct option *o, CURLU *uh, unsigned int changed,
+                   bool *modified)
+{
+  struct urlctx *c = o->ctx;
+  struct curl_slist *p;
+  bool url_is_invalid = false;
+  bool query_is_modified = false;
+  bool counted = true;
+  uint64_t t = stagebegin(o);
+  /* --append query= works on all the changes, not only the shown parts */
+  bool newquery = (changed & (1 << CURLUPART_QUERY)) != 0;
+
+  changed &= o->normparts;
+  /* a fastparse() URL has nothing to normalize */
+  if(changed && !c->fast.active) {
+    if(changed & (1 << CURLUPART_PATH)) {
       /* extract the current path */
       char *opath;
       char *cpath;
@@ -1909,235 +4090,1978 @@ static void singleurl(struct option *o,
         curl_free(opath);
         opath = npath;
         path_is_modified = true;
+        *modified = true;
       }
-      cpath = canonical_path(opath);
-      if(!cpath)
-        errorf(o, ERROR_MEM, "out of memory");
-
-      if(strcmp(cpath, opath)) {
+      cpath = canonical_path(o, opath);
+      if(cpath)
         /* updated */
         path_is_modified = true;
-        curl_free(opath);
-        opath = cpath;
-      }
-      else
-        curl_free(cpath);
       if(path_is_modified) {
         /* set the new path */
-        if(curl_url_set(uh, CURLUPART_PATH, opath, 0))
+        if(curl_url_set(uh, CURLUPART_PATH, cpath ? cpath : opath, 0))
           errorf(o, ERROR_MEM, "out of memory");
       }
       curl_free(opath);
+    }
 
+    if(changed & (1 << CURLUPART_FRAGMENT))
       normalize_part(o, uh, CURLUPART_FRAGMENT);
+    if(changed & (1 << CURLUPART_USER))
       normalize_part(o, uh, CURLUPART_USER);
+    if(changed & (1 << CURLUPART_PASSWORD))
       normalize_part(o, uh, CURLUPART_PASSWORD);
+    if(changed & (1 << CURLUPART_OPTIONS))
       normalize_part(o, uh, CURLUPART_OPTIONS);
-    }
+    t = stagedone(o, STAGE_NORMALIZE, t);
+  }
 
-    query_is_modified |= extractqpairs(uh, o);
+  query_is_modified |= extractqpairs(uh, o);
+  t = stagedone(o, STAGE_QPAIRS, t);
 
-    /* trim parts */
-    query_is_modified |= trim(o);
+  /* trim parts */
+  query_is_modified |= trim(o);
+  t = stagedone(o, STAGE_TRIM, t);
 
-    /* replace parts */
-    query_is_modified |= replace(o);
+  /* replace parts */
+  query_is_modified |= replace(o);
+  t = stagedone(o, STAGE_REPLACE, t);
 
-    if(first_lap) {
-      /* append query segments */
-      for(p = o->append_query; p; p = p->next) {
-        addqpair(p->data, strlen(p->data), o->jsonout);
-        query_is_modified = true;
-      }
+  if(newquery) {
+    /* append query segments */
+    for(p = o->append_query; p; p = p->next) {
+      addqpair(o, p->data, strlen(p->data));
+      query_is_modified = true;
     }
+  }
 
-    /* sort query */
-    query_is_modified |= sortquery(o);
+  /* sort query */
+  query_is_modified |= sortquery(o);
+  t = stagedone(o, STAGE_SORT, t);
 
-    /* put the query back */
-    if(query_is_modified)
-      qpair2query(uh, o);
+  /* put the query back */
+  if(query_is_modified) {
+    qpair2query(uh, o);
+    t = stagedone(o, STAGE_QUERY, t);
+  }
 
-    /* make sure the URL is still valid */
-    if(!url || o->redirect || o->set_list || o->append_path) {
-      char *ourl = NULL;
-      CURLUcode rc = curl_url_get(uh, CURLUPART_URL, &ourl, 0);
+  /* make sure the URL is still valid, if anything modified it since it
+     was parsed */
+  if(*modified) {
+    char *ourl = NULL;
+    CURLUcode rc = curl_url_get(uh, CURLUPART_URL, &ourl, 0);
+    if(rc) {
+      verify(o, ERROR_URL, "not enough input for a URL");
+      url_is_invalid = true;
+    }
+    else {
+      rc = seturl(o, uh, ourl);
       if(rc) {
-        if(o->verify) /* only clean up if we're exiting */
-          curl_url_cleanup(uh);
-        verify(o, ERROR_URL, "not enough input for a URL");
+        verify(o, ERROR_BADURL, "%s [%s]", curl_url_strerror(rc),
+               ourl);
         url_is_invalid = true;
       }
       else {
-        rc = seturl(o, uh, ourl);
-        if(rc) {
-          if(o->verify) /* only clean up if we're exiting */
-            curl_url_cleanup(uh);
-          verify(o, ERROR_BADURL, "%s [%s]", curl_url_strerror(rc),
-                 ourl);
-          url_is_invalid = true;
-        }
+        char *nurl = NULL;
+        rc = curl_url_get(uh, CURLUPART_URL, &nurl, 0);
+        if(!rc)
+          curl_free(nurl);
         else {
-          char *nurl = NULL;
-          rc = curl_url_get(uh, CURLUPART_URL, &nurl, 0);
-          if(!rc)
-            curl_free(nurl);
-          else {
-            if(o->verify) /* only clean up if we're exiting */
-              curl_url_cleanup(uh);
-            verify(o, ERROR_BADURL, "url became invalid");
-            url_is_invalid = true;
-          }
+          verify(o, ERROR_BADURL, "url became invalid");
+          url_is_invalid = true;
         }
-        curl_free(ourl);
       }
+      curl_free(ourl);
     }
+    t = stagedone(o, STAGE_VERIFY, t);
+  }
 
-    if(iter && iter->next)
-      ;
-    else if(url_is_invalid)
-      ;
-    else if(o->jsonout)
-      json(o, uh);
-    else if(o->format) {
-      /* custom output format */
-      get(o, uh);
-    }
-    else {
-      /* default output is full URL */
-      char *nurl = NULL;
-      int rc = geturlpart(o, 0, uh, CURLUPART_URL, &nurl);
-      if(!rc) {
-        printf("%s\n", nurl);
-        curl_free(nurl);
-      }
-    }
+  if(url_is_invalid)
+    ;
+  else if(o->count || o->count_keys)
+    countoutput(o, uh);
+  else if(o->unique)
+    counted = uniqueoutput(o, uh);
+  else
+    output(o, uh);
 
-    fflush(stdout);
+  if(o->line_buffered)
+    out_flush(c->out);
+  (void)stagedone(o, STAGE_OUTPUT, t);
 
-    freeqpairs();
+  urlctx_reset(c);
 
+  if(counted)
     o->urls++;
-
-    first_lap = false;
-  } while(iinfo->ptr);
-  if(!iinfo->uh)
-    curl_url_cleanup(uh);
 }
 
-int main(int argc, const char **argv)
+/* The number of --iterate combinations, SIZE_MAX if there are more */
+static size_t combinations(const struct option *o)
 {
-  int exit_status = 0;
-  struct option o;
-  struct curl_slist *node;
-  memset(&o, 0, sizeof(o));
-  setlocale(LC_ALL, "");
-  curl_global_init(CURL_GLOBAL_ALL);
+  size_t n = 1;
+  int i;
+  for(i = 0; i < o->niters; i++) {
+    if(n > SIZE_MAX / o->iters[i].nitems)
+      return SIZE_MAX;
+    n *= o->iters[i].nitems;
+  }
+  return n;
+}
 
-  for(argc--, argv++; argc > 0; argc--, argv++) {
-    bool usedarg = false;
-    if(!o.end_of_options && argv[0][0] == '-') {
-      /* dash-dash prefixed */
-      if(getarg(&o, argv[0], argv[1], &usedarg)) {
-        /* if the long option ends with an equals sign, cut it there,
-           if it is a short option, show just two letters */
-        size_t not_e = argv[0][1] == '-' ? strcspn(argv[0], "=") : 2;
-        errorf(&o, ERROR_FLAG, "unknown option: %.*s", (int)not_e, argv[0]);
-      }
-    }
-    else {
-      /* this is a URL */
-      urladd(&o, argv[0]);
+/* add a host name suffix to the filter trie, label by label from the
+   right */
+static void suffixadd(struct hostfilter *f, char *name, size_t len)
+{
+  int node = 0;
+  while(len) {
+    size_t start = len;
+    int n;
+    while(start && (name[start - 1] != '.'))
+      start--;
+    for(n = f->trie[node].child; n; n = f->trie[n].sibling)
+      if((f->trie[n].label.len == len - start) &&
+         !casecompare(f->trie[n].label.str, &name[start], len - start))
+        break;
+    if(!n) {
+      /* there is room for every label of every suffix */
+      n = f->ntrie++;
+      memset(&f->trie[n], 0, sizeof(struct labelnode));
+      f->trie[n].label.str = &name[start];
+      f->trie[n].label.len = len - start;
+      f->trie[n].sibling = f->trie[node].child;
+      f->trie[node].child = n;
     }
-    if(usedarg) {
-      /* skip the parsed argument */
-      argc--;
-      argv++;
-    }
-  }
-  if(!o.qsep)
-    o.qsep = "&";
-
-  if(o.jsonout)
-    putchar('[');
-
-  if(o.url) {
-    /* this is a file to read URLs from */
-    char buffer[4096]; /* arbitrary max */
-    bool end_of_file = false;
-    while(!end_of_file && fgets(buffer, sizeof(buffer), o.url)) {
-      char *eol = strchr(buffer, '\n');
-      if(eol && (eol > buffer)) {
-        if(eol[-1] == '\r')
-          /* CRLF detected */
-          eol--;
-      }
-      else if(eol == buffer) {
-        /* empty line */
-        continue;
-      }
-      else if(feof(o.url)) {
-        /* end of file */
-        eol = strlen(buffer) + buffer;
-        end_of_file = true;
-      }
-      else {
-        /* line too long */
-        int ch;
-        trurl_warnf(&o, "skipping long line");
-        do {
-          ch = getc(o.url);
-        } while(ch != EOF && ch != '\n');
-        if(ch == EOF) {
-          if(ferror(o.url))
-            trurl_warnf(&o, "getc: %s", strerror(errno));
-          end_of_file = true;
-        }
-        continue;
-      }
+    node = n;
+    len = start ? start - 1 : 0;
+  }
+  f->trie[node].end = true;
+}
 
-      /* trim trailing spaces and tabs */
-      while((eol > buffer) &&
-            ((eol[-1] == ' ') || eol[-1] == '\t'))
-        eol--;
-
-      if(eol > buffer) {
-        /* if there is actual content left to deal with */
-        struct iterinfo iinfo;
-        memset(&iinfo, 0, sizeof(iinfo));
-        *eol = 0; /* end of URL */
-        singleurl(&o, buffer, &iinfo, o.iter_list);
-      }
-    }
+#define ISBLANK(x) (((x) == ' ') || ((x) == '\t') || ((x) == '\r'))
 
-    if(!end_of_file && ferror(o.url))
-      trurl_warnf(&o, "fgets: %s", strerror(errno));
-    if(o.urlopen)
-      fclose(o.url);
+/* Read the --filter-host file into a hash of whole host names and a trie
+   of the '*.' suffixes. One name per line, '#' starts a comment line. */
+static void compilefilter(struct option *o)
+{
+  struct hostfilter *f = &o->filter;
+  FILE *file = fopen(o->filter_host, "rb");
+  size_t size = 0;
+  size_t alloc = 4096;
+  size_t labels = 1;
+  int lines = 1;
+  char *line;
+  char *end;
+  if(!file)
+    errorf(o, ERROR_FILE, "--filter-host %s: %s", o->filter_host,
+           strerror(errno));
+  f->data = malloc(alloc);
+  while(f->data) {
+    size += fread(&f->data[size], 1, alloc - size - 1, file);
+    if(size < alloc - 1)
+      break;
+    alloc *= 2;
+    line = realloc(f->data, alloc);
+    if(!line)
+      free(f->data);
+    f->data = line;
   }
-  else {
-    /* not reading URLs from a file */
-    node = o.url_list;
-    do {
-      if(node) {
-        const char *url = node->data;
-        struct iterinfo iinfo;
-        memset(&iinfo, 0, sizeof(iinfo));
-        singleurl(&o, url, &iinfo, o.iter_list);
-        node = node->next;
+  fclose(file);
+  if(!f->data)
+    errorf(o, ERROR_MEM, "out of memory");
+  f->data[size] = 0;
+  for(line = f->data; line < &f->data[size]; line++) {
+    if(*line == '\n')
+      lines++;
+    else if(*line == '.')
+      labels++;
+  }
+  labels += lines;
+  f->exact = malloc(lines * sizeof(struct string));
+  f->trie = calloc(labels, sizeof(struct labelnode));
+  if(!f->exact || !f->trie || !keyhash_reset(&f->hash, lines))
+    errorf(o, ERROR_MEM, "out of memory");
+  f->ntrie = 1; /* the root */
+
+  for(line = f->data; line < &f->data[size]; line = end + 1) {
+    size_t len;
+    end = memchr(line, '\n', &f->data[size] - line);
+    if(!end)
+      end = &f->data[size];
+    while((line < end) && ISBLANK(*line))
+      line++;
+    len = end - line;
+    while(len && ISBLANK(line[len - 1]))
+      len--;
+    if(!len || (*line == '#'))
+      continue;
+    if((len > 2) && !strncmp(line, "*.", 2))
+      suffixadd(f, &line[2], len - 2);
+    else {
+      f->exact[f->nexact].str = line;
+      f->exact[f->nexact].len = len;
+      if(!keyhash_add(&f->hash, f->nexact, hashkey(line, len, true)))
+        errorf(o, ERROR_MEM, "out of memory");
+      f->nexact++;
+    }
+  }
+}
+
+/* is this host name in the --filter-host file? */
+static bool hostmatch(const struct hostfilter *f, const char *host,
+                      size_t len)
+{
+  int node = 0;
+  if(len && (host[len - 1] == '.'))
+    /* the same host without the root label */
+    len--;
+  if(f->nexact) {
+    int e = keyhash_first(&f->hash, hashkey(host, len, true));
+    for(; e >= 0; e = keyhash_next(&f->hash, e))
+      if((f->exact[e].len == len) && !casecompare(host, f->exact[e].str, len))
+        return true;
+  }
+  /* walk the labels from the right as long as they are in the trie, a
+     suffix matches when there is at least one more label */
+  while(len) {
+    size_t start = len;
+    while(start && (host[start - 1] != '.'))
+      start--;
+    for(node = f->trie[node].child; node; node = f->trie[node].sibling)
+      if((f->trie[node].label.len == len - start) &&
+         !casecompare(f->trie[node].label.str, &host[start], len - start))
+        break;
+    if(!node || !start)
+      return false;
+    if(f->trie[node].end)
+      return true;
+    len = start - 1;
+  }
+  return false;
+}
+
+/* Returns true if --filter-host and --filter-scheme drop the URL */
+static bool filtered(struct option *o, CURLU *uh)
+{
+  bool match = true;
+  char *part;
+  if(o->ctx->fast.active) {
+    const struct fasturl *f = &o->ctx->fast;
+    struct curl_slist *n;
+    if(o->filter_scheme)
+      match = false;
+    for(n = o->filter_scheme; n && !match; n = n->next)
+      match = !casecompare(f->scheme, n->data, strlen(f->scheme) + 1);
+    if(!o->filter_scheme || match)
+      match = !o->filter_host || hostmatch(&o->filter, f->host, f->hostlen);
+  }
+  else if(o->filter_scheme) {
+    struct curl_slist *n;
+    match = false;
+    if(!curl_url_get(uh, CURLUPART_SCHEME, &part, 0)) {
+      for(n = o->filter_scheme; n && !match; n = n->next)
+        match = !casecompare(part, n->data, strlen(part) + 1);
+      curl_free(part);
+    }
+  }
+  if(match && o->filter_host && !o->ctx->fast.active) {
+    match = false;
+    if(!curl_url_get(uh, CURLUPART_HOST, &part, 0)) {
+      match = hostmatch(&o->filter, part, strlen(part));
+      curl_free(part);
+    }
+  }
+  if(match != o->filter_invert)
+    return false;
+  if(o->ctx->stats)
+    o->ctx->stats->filtered++;
+  return true;
+}
+
+/* Parse the URL into the handle of this context and set the --set
+   components. Returns the handle, or NULL if the URL is skipped. */
+static CURLU *urlsetup(struct option *o, const char *url, bool *modified)
+{
+  CURLU *uh;
+  unsigned int setmask;
+  int i;
+  uint64_t t = stagebegin(o);
+  if(o->ctx->stats)
+    o->ctx->stats->urls++;
+  /* reuse the handle of this context, cleared from the previous URL */
+  uh = o->ctx->uh;
+  if(!uh) {
+    uh = o->ctx->uh = curl_url();
+    if(!uh)
+      errorf(o, ERROR_MEM, "out of memory");
+  }
+  o->ctx->fast.active = false;
+  *modified = !url;
+  if(url && o->fastparse && fastparse(o, url))
+    t = stagedone(o, STAGE_SETURL, t);
+  else if(url) {
+    CURLUcode rc;
+    (void)curl_url_set(uh, CURLUPART_URL, NULL, 0);
+    rc = seturl(o, uh, url);
+    if(rc) {
+      verify(o, ERROR_BADURL, "%s [%s]", curl_url_strerror(rc), url);
+      return NULL;
+    }
+    if(o->redirect) {
+      rc = seturl(o, uh, o->redirect);
+      if(rc) {
+        verify(o, ERROR_BADURL, "invalid redirection: %s [%s]",
+               curl_url_strerror(rc), o->redirect);
+        return NULL;
       }
-      else {
-        struct iterinfo iinfo;
-        memset(&iinfo, 0, sizeof(iinfo));
-        o.verify = true;
-        singleurl(&o, NULL, &iinfo, o.iter_list);
+    }
+    t = stagedone(o, STAGE_SETURL, t);
+  }
+  else
+    (void)curl_url_set(uh, CURLUPART_URL, NULL, 0);
+  if(url && (o->filter_host || o->filter_scheme) && filtered(o, uh))
+    return NULL;
+
+  /* set everything */
+  setmask = set(uh, o, modified);
+  if(setmask & o->itermask) {
+    for(i = 0; !(setmask & (1 << o->iters[i].v->part)); i++)
+      ;
+    errorf(o, ERROR_ITER, "duplicate --iterate and --set for component %s",
+           o->iters[i].v->name);
+  }
+  (void)stagedone(o, STAGE_SET, t);
+  return uh;
+}
+
+/* Show 'count' of the --iterate combinations of the URL in 'uh', starting
+   with combination 'first'. The last list changes the fastest. Only the
+   components that differ from the previous combination are set again. */
+static void iterate(struct option *o, CURLU *uh, size_t first, size_t count,
+                    bool *modified)
+{
+  unsigned int changed = ~0u; /* everything is new in the first one */
+  size_t pos[sizeof(variables) / sizeof(variables[0])];
+  int i;
+  uint64_t t = stagebegin(o);
+  for(i = o->niters - 1; i >= 0; i--) {
+    pos[i] = first % o->iters[i].nitems;
+    first /= o->iters[i].nitems;
+    iterset(o, uh, &o->iters[i], pos[i]);
+  }
+  if(o->niters)
+    /* urlsetup() counted the URL without --iterate */
+    (void)stagedone(o, STAGE_SET, t);
+  while(count--) {
+    oneurl(o, uh, changed, modified);
+    if(!count)
+      break;
+
+    for(i = o->niters - 1; i >= 0; i--) {
+      if(++pos[i] < o->iters[i].nitems)
+        break;
+      pos[i] = 0;
+    }
+    if(i < 0)
+      /* back at the first combination */
+      break;
+    t = stagebegin(o);
+    changed = 0;
+    for(; i < o->niters; i++) {
+      iterset(o, uh, &o->iters[i], pos[i]);
+      changed |= 1 << o->iters[i].v->part;
+    }
+    (void)stagedone(o, STAGE_SET, t);
+  }
+}
+
+static void singleurl(struct option *o,
+                      const char *url) /* might be NULL */
+{
+  bool modified;
+  CURLU *uh = urlsetup(o, url, &modified);
+  if(uh)
+    iterate(o, uh, 0, combinations(o), &modified);
+}
+
+/* parse the command line arguments into the options. If 'isurl' is set,
+   it gets every argument marked if it was a URL */
+static void parseargs(struct option *o, int argc, const char **argv,
+                      bool *isurl)
+{
+  int i;
+  for(i = 0; i < argc; i++) {
+    bool usedarg = false;
+    if(isurl)
+      isurl[i] = false;
+    if(!o->end_of_options && argv[i][0] == '-') {
+      /* dash-dash prefixed */
+      if(getarg(o, argv[i], (i + 1 < argc) ? argv[i + 1] : NULL,
+                &usedarg)) {
+        /* if the long option ends with an equals sign, cut it there,
+           if it is a short option, show just two letters */
+        size_t not_e = argv[i][1] == '-' ? strcspn(argv[i], "=") : 2;
+        errorf(o, ERROR_FLAG, "unknown option: %.*s", (int)not_e, argv[i]);
+      }
+    }
+    else {
+      /* this is a URL */
+      urladd(o, argv[i]);
+      if(isurl)
+        isurl[i] = true;
+    }
+    if(usedarg) {
+      /* skip the parsed argument */
+      i++;
+      if(isurl)
+        isurl[i] = false;
+    }
+  }
+}
+
+/* prepare the options for use once all arguments are parsed */
+/* Split each --iterate list into its items once. The items are separated
+   by single spaces. */
+static void compileiter(struct option *o)
+{
+  struct curl_slist *node;
+  int n = 0;
+  for(node = o->iter_list; node; node = node->next)
+    n++;
+  o->iters = calloc(n, sizeof(struct iterlist));
+  if(!o->iters)
+    errorf(o, ERROR_MEM, "out of memory");
+  for(node = o->iter_list; node; node = node->next) {
+    /* "part=item1 item2 item2" */
+    struct iterlist *it = &o->iters[o->niters];
+    char *part = node->data;
+    char *sep = strchr(part, '=');
+    char *w;
+    size_t plen;
+    size_t i;
+    bool urlencode = true;
+    if(!sep)
+      errorf(o, ERROR_ITER, "wrong iterate syntax");
+    plen = sep - part;
+    if(plen && (sep[-1] == ':')) {
+      urlencode = false;
+      plen--;
+    }
+    it->v = comp2var(part, plen);
+    if(!it->v)
+      errorf(o, ERROR_ITER, "bad component for iterate");
+    if(o->itermask & (1 << it->v->part))
+      errorf(o, ERROR_ITER,
+             "duplicate component for iterate: %s", it->v->name);
+    it->urlencode = urlencode;
+    it->nitems = 1;
+    for(w = sep + 1; (w = strchr(w, ' ')); w++)
+      it->nitems++;
+    it->items = malloc(it->nitems * sizeof(char *));
+    if(!it->items)
+      errorf(o, ERROR_MEM, "out of memory");
+    o->niters++;
+    o->itermask |= 1 << it->v->part;
+    w = sep + 1;
+    for(i = 0; i < it->nitems; i++) {
+      it->items[i] = w;
+      w = strchr(w, ' ');
+      if(w)
+        *w++ = 0;
+    }
+  }
+}
+
+/* The parts that need normalizing are the ones shown. When only some
+   components are extracted and nothing modifies the URL, the others are
+   left alone. */
+static unsigned int normparts(const struct option *o)
+{
+  unsigned int parts = 0;
+  int i;
+  if((!o->format && !o->count_keys) || o->set_list || o->iter_list ||
+     o->append_path || o->append_query || o->redirect)
+    return ~0u;
+  if(o->count_keys)
+    parts |= 1 << CURLUPART_QUERY;
+  for(i = 0; i < o->ngetops; i++) {
+    const struct getop *op = &o->getops[i];
+    if(op->type == GETOP_URL)
+      return ~0u;
+    if(op->type == GETOP_COMPONENT)
+      parts |= 1 << op->v->part;
+    else if(op->type == GETOP_QUERY)
+      parts |= 1 << CURLUPART_QUERY;
+  }
+  return parts;
+}
+
+static void setupoptions(struct option *o)
+{
+  if(!o->qsep)
+    o->qsep = "&";
+
+  if(o->count || o->count_keys) {
+    const char *flag = o->count ? "--count" : "--count-keys";
+    if(o->jsonout)
+      errorf(o, ERROR_FLAG, "%s is mutually exclusive with %s", flag,
+             o->jsonlines ? "--jsonl" : "--json");
+    if(o->columnar)
+      errorf(o, ERROR_FLAG, "%s is mutually exclusive with --columnar",
+             flag);
+    if(o->count_keys && o->format)
+      errorf(o, ERROR_FLAG, "--count-keys is mutually exclusive with %s",
+             o->count ? "--count" : "--get");
+  }
+  if(o->format)
+    compileget(o);
+  if(o->trim_list)
+    compiletrim(o);
+  if(o->filter_host)
+    compilefilter(o);
+  if(o->compress && o->serve)
+    errorf(o, ERROR_FLAG,
+           "--compress-output is mutually exclusive with --serve");
+#ifndef TRURL_NO_FASTPARSE
+  /* these need the URL in the libcurl handle at once */
+  o->fastparse = !o->set_list && !o->iter_list && !o->redirect &&
+    !o->append_path;
+#endif
+  if(o->iter_list)
+    compileiter(o);
+  o->normparts = normparts(o);
+}
+
+#ifdef USE_COMPRESSION
+/* --compress-output, the output goes through a compressor */
+static void pack_start(struct option *o, struct outbuf *ob)
+{
+  struct packer *p = calloc(1, sizeof(*p));
+  bool ok = false;
+  if(p) {
+    p->type = o->compress;
+    p->stream = ob->stream;
+    p->buf = malloc(PACK_BLOCK);
+#ifdef HAVE_ZLIB
+    if(p->type == PACK_GZIP)
+      /* sixteen more window bits makes it gzip instead of zlib */
+      ok = deflateInit2(&p->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                        MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+#endif
+#ifdef HAVE_ZSTD
+    if(p->type == PACK_ZSTD) {
+      p->zc = ZSTD_createCStream();
+      ok = p->zc != NULL;
+    }
+#endif
+  }
+  if(!ok || !p->buf) {
+    if(p)
+      free(p->buf);
+    free(p);
+    errorf(o, ERROR_MEM, "out of memory");
+  }
+  ob->pack = p;
+}
+#endif
+
+/* what goes before the first URL */
+static void openoutput(struct option *o, struct outbuf *ob)
+{
+  if(o->jsonout && !o->jsonlines)
+    out_char(ob, '[');
+  else if(o->columnar)
+    colheader(ob);
+}
+
+/* the URLs given as arguments, or the one made from --set if none */
+static void urllist(struct option *o)
+{
+  struct curl_slist *node = o->url_list;
+  if(!node) {
+    o->verify = true;
+    singleurl(o, NULL);
+  }
+  for(; node; node = node->next)
+    singleurl(o, node->data);
+}
+
+#ifndef TRURL_LIBRARY
+/* IDN conversions depend on the locale, it is only set up for the options
+   that convert */
+static bool needlocale(const struct option *o)
+{
+  int i;
+  if(o->punycode || o->puny2idn)
+    return true;
+  for(i = 0; i < o->ngetops; i++)
+    if(o->getops[i].mods & (VARMODIFIER_PUNY | VARMODIFIER_PUNY2IDN))
+      return true;
+  return false;
+}
+
+#define READ_BLOCK 65536 /* minimum read size for --url-file */
+
+/* Reads what is available, up to 'room' bytes. Returns zero at the end of
+   the file, with the errno of a read error in 'err' or zero. */
+static size_t readraw(FILE *f, char *buf, size_t room, int *err)
+{
+  *err = 0;
+#ifdef _WIN32
+  {
+    size_t n = fread(buf, 1, room, f);
+    if(!n && ferror(f))
+      *err = errno;
+    return n;
+  }
+#else
+  /* read() returns what is available, so piped input is not delayed */
+  for(;;) {
+    ssize_t rc = read(fileno(f), buf, room);
+    if(rc > 0)
+      return (size_t)rc;
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc < 0)
+      *err = errno;
+    return 0;
+  }
+#endif
+}
+
+#ifdef USE_COMPRESSION
+#define UNPACK_BLOCKS 4 /* decompressed blocks the thread is ahead */
+
+/* decompresses a gzip or zstd --url-file */
+struct unpacker {
+  enum packtype type;
+  FILE *f;
+  char *in; /* compressed data */
+  size_t inlen;
+  size_t inpos;
+  bool ineof;
+  bool inframe; /* inside a gzip member or zstd frame */
+  bool done;
+  int readerr; /* errno of a failed read */
+  const char *error; /* the data is broken */
+#ifdef HAVE_ZLIB
+  z_stream zs;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zd;
+#endif
+#ifdef USE_THREADS
+  /* the thread decompresses into the ring of blocks, the reader copies
+     from 'head' */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond; /* a block was filled or emptied */
+  char *blocks[UNPACK_BLOCKS];
+  size_t blen[UNPACK_BLOCKS];
+  size_t head;
+  size_t tail;
+  size_t pos; /* read position in the head block */
+  bool finished; /* the thread is done */
+  bool quit;
+  bool threaded;
+#endif
+};
+
+/* decompresses what the input has into 'dst', once */
+static size_t unpack_step(struct unpacker *u, char *dst, size_t room)
+{
+  size_t n = 0;
+#ifdef HAVE_ZLIB
+  if(u->type == PACK_GZIP) {
+    int rc;
+    u->zs.next_in = (const Bytef *)&u->in[u->inpos];
+    u->zs.avail_in = (uInt)(u->inlen - u->inpos);
+    u->zs.next_out = (Bytef *)dst;
+    u->zs.avail_out = (uInt)room;
+    rc = inflate(&u->zs, Z_NO_FLUSH);
+    u->inpos = u->inlen - u->zs.avail_in;
+    n = room - u->zs.avail_out;
+    if(rc == Z_STREAM_END) {
+      /* another gzip member may follow */
+      u->inframe = false;
+      inflateReset(&u->zs);
+    }
+    else if(rc == Z_OK)
+      u->inframe = true;
+    else if(rc != Z_BUF_ERROR) {
+      u->error = "bad gzip data";
+      u->done = true;
+    }
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if(u->type == PACK_ZSTD) {
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t rc;
+    in.src = u->in;
+    in.size = u->inlen;
+    in.pos = u->inpos;
+    out.dst = dst;
+    out.size = room;
+    out.pos = 0;
+    rc = ZSTD_decompressStream(u->zd, &out, &in);
+    if(ZSTD_isError(rc)) {
+      u->error = "bad zstd data";
+      u->done = true;
+    }
+    else if(out.pos || (in.pos != u->inpos))
+      /* zero is the end of a frame, only when there was progress */
+      u->inframe = rc != 0;
+    u->inpos = in.pos;
+    n = out.pos;
+  }
+#endif
+  return n;
+}
+
+/* Decompresses into 'dst'. Returns zero at the end of the data. */
+static size_t unpack(struct unpacker *u, char *dst, size_t room)
+{
+  while(!u->done) {
+    size_t n;
+    if((u->inpos == u->inlen) && !u->ineof) {
+      u->inlen = readraw(u->f, u->in, PACK_BLOCK, &u->readerr);
+      u->inpos = 0;
+      u->ineof = !u->inlen;
+    }
+    n = unpack_step(u, dst, room);
+    if(n)
+      return n;
+    if((u->inpos == u->inlen) && u->ineof) {
+      if(u->inframe && !u->error)
+        u->error = (u->type == PACK_GZIP) ? "truncated gzip data" :
+          "truncated zstd data";
+      u->done = true;
+    }
+  }
+  return 0;
+}
+
+#ifdef USE_THREADS
+static void *unpack_thread(void *arg)
+{
+  struct unpacker *u = arg;
+  for(;;) {
+    size_t slot;
+    size_t n;
+    pthread_mutex_lock(&u->lock);
+    while(!u->quit && (u->tail - u->head == UNPACK_BLOCKS))
+      pthread_cond_wait(&u->cond, &u->lock);
+    if(u->quit) {
+      pthread_mutex_unlock(&u->lock);
+      break;
+    }
+    slot = u->tail % UNPACK_BLOCKS;
+    pthread_mutex_unlock(&u->lock);
+
+    n = unpack(u, u->blocks[slot], READ_BLOCK);
+
+    pthread_mutex_lock(&u->lock);
+    u->blen[slot] = n;
+    if(n)
+      u->tail++;
+    else
+      u->finished = true;
+    pthread_cond_signal(&u->cond);
+    pthread_mutex_unlock(&u->lock);
+    if(!n)
+      break;
+  }
+  return NULL;
+}
+#endif
+
+/* the next part of the decompressed data, zero at the end */
+static size_t unpack_read(struct unpacker *u, char *dst, size_t room)
+{
+#ifdef USE_THREADS
+  if(u->threaded) {
+    size_t slot;
+    size_t n;
+    pthread_mutex_lock(&u->lock);
+    while((u->head == u->tail) && !u->finished)
+      pthread_cond_wait(&u->cond, &u->lock);
+    if(u->head == u->tail) {
+      pthread_mutex_unlock(&u->lock);
+      return 0;
+    }
+    pthread_mutex_unlock(&u->lock);
+    /* the head block is not touched by the thread until released */
+    slot = u->head % UNPACK_BLOCKS;
+    n = u->blen[slot] - u->pos;
+    if(n > room)
+      n = room;
+    memcpy(dst, &u->blocks[slot][u->pos], n);
+    u->pos += n;
+    if(u->pos == u->blen[slot]) {
+      pthread_mutex_lock(&u->lock);
+      u->head++;
+      u->pos = 0;
+      pthread_cond_signal(&u->cond);
+      pthread_mutex_unlock(&u->lock);
+    }
+    return n;
+  }
+#endif
+  return unpack(u, dst, room);
+}
+
+static void unpack_free(struct unpacker *u)
+{
+#ifdef USE_THREADS
+  int i;
+  if(u->threaded) {
+    pthread_mutex_lock(&u->lock);
+    u->quit = true;
+    pthread_cond_signal(&u->cond);
+    pthread_mutex_unlock(&u->lock);
+    pthread_join(u->thread, NULL);
+    pthread_mutex_destroy(&u->lock);
+    pthread_cond_destroy(&u->cond);
+  }
+  for(i = 0; i < UNPACK_BLOCKS; i++)
+    free(u->blocks[i]);
+#endif
+#ifdef HAVE_ZLIB
+  if(u->type == PACK_GZIP)
+    inflateEnd(&u->zs);
+#endif
+#ifdef HAVE_ZSTD
+  if(u->type == PACK_ZSTD)
+    ZSTD_freeDStream(u->zd);
+#endif
+  free(u->in);
+  free(u);
+}
+
+/* Starts decompressing, with the 'len' bytes of 'data' read from 'f' so
+   far. Returns NULL if the data is not compressed. */
+static struct unpacker *unpack_start(struct option *o, FILE *f,
+                                     const char *data, size_t len, bool eof)
+{
+  const unsigned char *magic = (const unsigned char *)data;
+  enum packtype type = PACK_NONE;
+  struct unpacker *u;
+  bool ok = false;
+#ifdef HAVE_ZLIB
+  if((len >= 2) && (magic[0] == 0x1f) && (magic[1] == 0x8b))
+    type = PACK_GZIP;
+#endif
+#ifdef HAVE_ZSTD
+  if((len >= 4) && (magic[0] == 0x28) && (magic[1] == 0xb5) &&
+     (magic[2] == 0x2f) && (magic[3] == 0xfd))
+    type = PACK_ZSTD;
+#endif
+  if(!type)
+    return NULL;
+  u = calloc(1, sizeof(*u));
+  if(u) {
+    u->type = type;
+    u->f = f;
+    u->ineof = eof;
+    u->in = malloc(PACK_BLOCK);
+#ifdef HAVE_ZLIB
+    if(type == PACK_GZIP)
+      ok = inflateInit2(&u->zs, MAX_WBITS + 16) == Z_OK;
+#endif
+#ifdef HAVE_ZSTD
+    if(type == PACK_ZSTD) {
+      u->zd = ZSTD_createDStream();
+      ok = u->zd != NULL;
+    }
+#endif
+  }
+  if(!ok || !u->in) {
+    if(u)
+      free(u->in);
+    free(u);
+    errorf(o, ERROR_MEM, "out of memory");
+  }
+  memcpy(u->in, data, len);
+  u->inlen = len;
+#ifdef USE_THREADS
+  {
+    int i;
+    for(i = 0; i < UNPACK_BLOCKS; i++) {
+      u->blocks[i] = malloc(READ_BLOCK);
+      if(!u->blocks[i])
+        break;
+    }
+    /* without the thread, the reader decompresses */
+    if((i == UNPACK_BLOCKS) && !pthread_mutex_init(&u->lock, NULL)) {
+      if(pthread_cond_init(&u->cond, NULL))
+        pthread_mutex_destroy(&u->lock);
+      else if(pthread_create(&u->thread, NULL, unpack_thread, u)) {
+        pthread_cond_destroy(&u->cond);
+        pthread_mutex_destroy(&u->lock);
+      }
+      else
+        u->threaded = true;
+    }
+  }
+#endif
+  return u;
+}
+#endif
+
+/* Reads the URL file in large blocks into a single buffer that grows to fit
+   the longest line. Lines are handed out as pointers into the buffer. */
+struct linereader {
+  FILE *f;
+  char *buf;
+  size_t size;  /* allocated size of buf */
+  size_t start; /* first byte not yet returned as a line */
+  size_t end;   /* end of the data read so far */
+  bool eof;
+#ifdef USE_COMPRESSION
+  bool detect;  /* the start of the file tells if it is compressed */
+  struct unpacker *unpack;
+#endif
+};
+
+/* reads more at the end of the buffer, which has room for it */
+static void reader_read(struct option *o, struct linereader *r)
+{
+  /* leave one byte for the zero terminator of a last unterminated line */
+  size_t room = r->size - r->end - 1;
+  size_t n;
+  int err;
+#ifdef USE_COMPRESSION
+  if(r->unpack) {
+    struct unpacker *u = r->unpack;
+    n = unpack_read(u, &r->buf[r->end], room);
+    if(!n) {
+      if(u->readerr)
+        trurl_warnf(o, "read: %s", strerror(u->readerr));
+      else if(u->error)
+        trurl_warnf(o, "--url-file: %s", u->error);
+      r->eof = true;
+    }
+    r->end += n;
+    return;
+  }
+#endif
+  n = readraw(r->f, &r->buf[r->end], room, &err);
+  if(!n) {
+    if(err)
+      trurl_warnf(o, "read: %s", strerror(err));
+    r->eof = true;
+  }
+  r->end += n;
+}
+
+#ifdef USE_COMPRESSION
+/* true while the data read so far can be the start of gzip or zstd */
+static bool partmagic(const char *data, size_t len)
+{
+  return ((len < 2) && !memcmp(data, "\x1f\x8b", len)) ||
+    ((len < 4) && !memcmp(data, "\x28\xb5\x2f\xfd", len));
+}
+#endif
+
+static void reader_fill(struct option *o, struct linereader *r)
+{
+  if(r->start) {
+    /* move the unfinished line to the start of the buffer */
+    memmove(r->buf, &r->buf[r->start], r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+  if(r->size - r->end <= READ_BLOCK / 4) {
+    /* make room for more, double the size */
+    size_t nsize = r->size ? r->size * 2 : READ_BLOCK;
+    char *nbuf = realloc(r->buf, nsize);
+    if(!nbuf)
+      errorf(o, ERROR_MEM, "out of memory");
+    r->buf = nbuf;
+    r->size = nsize;
+  }
+  reader_read(o, r);
+#ifdef USE_COMPRESSION
+  if(r->detect) {
+    /* the first bytes of the file tell if it is compressed */
+    r->detect = false;
+    while(!r->eof && partmagic(r->buf, r->end))
+      reader_read(o, r);
+    r->unpack = unpack_start(o, r->f, r->buf, r->end, r->eof);
+    if(r->unpack) {
+      /* what was read is compressed, the URLs come from the unpacker */
+      r->end = 0;
+      r->eof = false;
+    }
+  }
+#endif
+}
+
+/* Returns the next line, its newline replaced with a zero, or NULL when the
+   file is done. The line stays valid until the next call. */
+static char *reader_line(struct option *o, struct linereader *r,
+                         size_t *lenp)
+{
+  for(;;) {
+    char *line = &r->buf[r->start];
+    size_t avail = r->end - r->start;
+    char *eol = avail ? memchr(line, '\n', avail) : NULL;
+    if(eol) {
+      *eol = 0;
+      *lenp = eol - line;
+      r->start += *lenp + 1;
+      return line;
+    }
+    if(r->eof) {
+      if(!avail)
+        return NULL;
+      /* last line without a newline */
+      line[avail] = 0;
+      *lenp = avail;
+      r->start = r->end;
+      return line;
+    }
+    reader_fill(o, r);
+  }
+}
+
+#ifdef USE_THREADS
+#define JOB_LINES 256 /* URLs or --iterate combinations per job */
+#define JOBS_PER_WORKER 4 /* size of the reorder window */
+
+struct worker {
+  pthread_t thread;
+  struct pool *pool;
+  struct option opt; /* private copy of the options */
+  struct urlctx ctx;
+};
+
+/* The reader fills the job at 'tail', workers pick up jobs from 'next' and
+   the jobs are written in order from 'head' once done. The ring of jobs is
+   the reorder buffer. */
+struct pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work; /* a new job was queued */
+  pthread_cond_t done; /* a job was completed */
+  struct job *jobs;
+  size_t njobs;
+  size_t head;
+  size_t next;
+  size_t tail;
+  bool quit;
+  struct worker *workers;
+  unsigned int nworkers;
+  struct stats *stats; /* where the workers add theirs, with --stats */
+  struct option *o; /* of the main thread */
+};
+
+static void runlines(struct option *o, struct job *job)
+{
+  const char *line = job->lines;
+  size_t i;
+  for(i = 0; i < job->nlines; i++) {
+    singleurl(o, line);
+    line += strlen(line) + 1;
+  }
+  job->urls = o->urls;
+}
+
+static void runjob(struct worker *w, struct job *job)
+{
+  struct option *o = &w->opt;
+  o->urls = 0;
+  w->ctx.job = job;
+  w->ctx.out = &job->out;
+  w->ctx.err = &job->err;
+  if(!setjmp(job->jmp)) {
+    if(job->base) {
+      iterate(o, job->base, job->first, job->count, &job->modified);
+      job->urls = o->urls;
+    }
+    else
+      runlines(o, job);
+    /* batches do not span jobs */
+    colflush(o);
+  }
+  curl_url_cleanup(job->base);
+  job->base = NULL;
+  urlctx_reset(&w->ctx);
+  w->ctx.job = NULL;
+}
+
+static void *worker_thread(void *arg)
+{
+  struct worker *w = arg;
+  struct pool *p = w->pool;
+  for(;;) {
+    struct job *job;
+    pthread_mutex_lock(&p->lock);
+    while(!p->quit && (p->next == p->tail))
+      pthread_cond_wait(&p->work, &p->lock);
+    if(p->next == p->tail) {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+    job = &p->jobs[p->next++ % p->njobs];
+    pthread_mutex_unlock(&p->lock);
+
+    runjob(w, job);
+
+    pthread_mutex_lock(&p->lock);
+    job->done = true;
+    pthread_cond_broadcast(&p->done);
+    pthread_mutex_unlock(&p->lock);
+  }
+  return NULL;
+}
+
+static void pool_stop(struct pool *p)
+{
+  unsigned int i;
+  pthread_mutex_lock(&p->lock);
+  p->quit = true;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+  for(i = 0; i < p->nworkers; i++) {
+    pthread_join(p->workers[i].thread, NULL);
+    if(p->stats && p->workers[i].ctx.stats)
+      stats_merge(p->stats, p->workers[i].ctx.stats);
+    if(p->o->count || p->o->count_keys)
+      counter_merge(p->o, &p->o->ctx->counts, &p->workers[i].ctx.counts);
+    urlctx_cleanup(&p->workers[i].ctx);
+  }
+  p->nworkers = 0;
+}
+
+static void pool_free(struct pool *p)
+{
+  size_t i;
+  for(i = 0; i < p->njobs; i++) {
+    curl_url_cleanup(p->jobs[i].base);
+    free(p->jobs[i].recs);
+    free(p->jobs[i].lines);
+    out_free(&p->jobs[i].out);
+    out_free(&p->jobs[i].err);
+  }
+  free(p->jobs);
+  free(p->workers);
+  pthread_cond_destroy(&p->work);
+  pthread_cond_destroy(&p->done);
+  pthread_mutex_destroy(&p->lock);
+}
+
+static bool pool_start(struct option *o, struct pool *p)
+{
+  unsigned int i;
+  memset(p, 0, sizeof(*p));
+  p->njobs = (size_t)o->parallel * JOBS_PER_WORKER;
+  p->jobs = calloc(p->njobs, sizeof(struct job));
+  p->workers = calloc(o->parallel, sizeof(struct worker));
+  if(!p->jobs || !p->workers) {
+    free(p->jobs);
+    free(p->workers);
+    return false;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->stats = o->ctx->stats;
+  p->o = o;
+  for(i = 0; i < o->parallel; i++) {
+    struct worker *w = &p->workers[i];
+    w->pool = p;
+    w->opt = *o;
+    w->opt.ctx = &w->ctx;
+    w->ctx.pooled = true;
+    if(p->stats)
+      /* without memory, this worker is left out of the stats */
+      w->ctx.stats = calloc(1, sizeof(struct stats));
+    if(pthread_create(&w->thread, NULL, worker_thread, w))
+      break;
+  }
+  p->nworkers = i;
+  if(!i) {
+    pool_free(p);
+    return false;
+  }
+  return true;
+}
+
+/* write the output of the oldest job, wait for it to complete if needed */
+static void pool_write(struct option *o, struct pool *p, bool wait)
+{
+  struct job *job = &p->jobs[p->head % p->njobs];
+  bool done;
+  pthread_mutex_lock(&p->lock);
+  while(wait && !job->done)
+    pthread_cond_wait(&p->done, &p->lock);
+  done = job->done;
+  pthread_mutex_unlock(&p->lock);
+  if(!done)
+    return;
+
+  if(job->exit_code)
+    /* no more output is wanted after this job */
+    pool_stop(p);
+
+  if(job->out.oom || job->err.oom) {
+    pool_stop(p);
+    errorf(o, ERROR_MEM, "out of memory");
+  }
+
+  if(o->unique && job->nrecs) {
+    /* the outputs not seen before */
+    const char *data = job->out.buf;
+    size_t i;
+    for(i = 0; i < job->nrecs; i++) {
+      size_t len = job->recs[i].len;
+      const char *body = recordbody(o, data, &len);
+      if(urlset_add(o, &o->ctx->seen, job->recs[i].fp, body, len)) {
+        if(o->jsonout && !o->jsonlines && o->urls)
+          out_char(o->ctx->out, ',');
+        out_write(o->ctx->out, body, len);
+        o->urls++;
       }
-    } while(node);
+      data += job->recs[i].len;
+    }
+    job->urls = 0;
+  }
+  else {
+    if(job->jsonsep && o->urls)
+      out_char(o->ctx->out, ',');
+    out_write(o->ctx->out, job->out.buf, job->out.len);
+  }
+  if(job->closeout)
+    closeoutput(o, o->ctx->out, o->urls + job->urls);
+  if(job->err.len) {
+    out_flush(o->ctx->out);
+    out_write(o->ctx->err, job->err.buf, job->err.len);
+    out_flush(o->ctx->err);
+  }
+  if(o->line_buffered)
+    out_flush(o->ctx->out);
+  o->urls += job->urls;
+
+  if(job->exit_code) {
+    pool_free(p);
+    bailout(o, job->exit_code);
+  }
+
+  job->out.len = job->err.len = 0;
+  job->used = job->nlines = job->nrecs = 0;
+  job->urls = 0;
+  job->jsonsep = job->closeout = job->done = false;
+  p->head++;
+}
+
+/* queue the job being filled and start filling the next one */
+static void pool_submit(struct option *o, struct pool *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->tail++;
+  pthread_cond_signal(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  /* write what is ready, and make room for a new job */
+  while(p->head != p->tail) {
+    bool full = (p->tail - p->head) == p->njobs;
+    size_t head = p->head;
+    pool_write(o, p, full);
+    if(head == p->head)
+      break;
+  }
+}
+
+static void pool_add(struct option *o, struct pool *p,
+                     const char *line, size_t len)
+{
+  struct job *job = &p->jobs[p->tail % p->njobs];
+  if(job->used + len + 1 > job->alloc) {
+    size_t alloc = (job->alloc ? job->alloc : 4096);
+    char *n;
+    while(job->used + len + 1 > alloc)
+      alloc *= 2;
+    n = realloc(job->lines, alloc);
+    if(!n)
+      errorf(o, ERROR_MEM, "out of memory");
+    job->lines = n;
+    job->alloc = alloc;
+  }
+  memcpy(&job->lines[job->used], line, len);
+  job->lines[job->used + len] = 0;
+  job->used += len + 1;
+  if(++job->nlines == JOB_LINES)
+    pool_submit(o, p);
+}
+
+/* Split the --iterate combinations of a URL into jobs. The URL is parsed
+   here, with the notes and errors going to the first job, and each job
+   gets a copy of the handle to set the iterated components in. */
+/* urlsetup() for pool_iterate() with the errors ending up in 'job'.
+   Returns NULL if they stopped it. Kept apart from the caller so that no
+   local variable lives across the setjmp(). */
+static CURLU *jobsetup(struct option *o, struct job *job, const char *url,
+                       bool *modified)
+{
+  if(setjmp(job->jmp))
+    return NULL;
+  return urlsetup(o, url, modified);
+}
+
+static void pool_iterate(struct option *o, struct pool *p, const char *url)
+{
+  struct urlctx *c = o->ctx;
+  struct outbuf *out = c->out;
+  struct outbuf *err = c->err;
+  struct option uo = *o;
+  struct job *job;
+  CURLU *uh;
+  size_t total = combinations(o);
+  size_t first;
+  bool modified = false;
+
+  if(p->jobs[p->tail % p->njobs].nlines)
+    pool_submit(o, p);
+  job = &p->jobs[p->tail % p->njobs];
+  uo.urls = 0; /* like in a worker */
+  c->out = &job->out;
+  c->err = &job->err;
+  c->job = job;
+  uh = jobsetup(&uo, job, url, &modified);
+  c->job = NULL;
+  c->out = out;
+  c->err = err;
+  if(!uh) {
+    /* only the notes, or the error */
+    pool_submit(o, p);
+    return;
+  }
+  for(first = 0; first < total; first += JOB_LINES) {
+    job = &p->jobs[p->tail % p->njobs];
+    job->base = curl_url_dup(uh);
+    if(!job->base)
+      errorf(o, ERROR_MEM, "out of memory");
+    job->first = first;
+    job->count = (total - first < JOB_LINES) ? total - first : JOB_LINES;
+    job->modified = modified;
+    pool_submit(o, p);
+  }
+}
+
+/* process the remaining lines and write all output */
+static void pool_finish(struct option *o, struct pool *p)
+{
+  if(p->jobs[p->tail % p->njobs].nlines)
+    pool_submit(o, p);
+  while(p->head != p->tail)
+    pool_write(o, p, true);
+  pool_stop(p);
+  pool_free(p);
+}
+#endif
+
+/* read the URLs from the --url-file */
+static void readurls(struct option *o)
+{
+  struct linereader reader;
+  char *buffer;
+  size_t len;
+#ifdef USE_THREADS
+  struct pool pool;
+  /* --unique --columnar batches cannot be made unique afterwards */
+  bool parallel = (o->parallel > 1) && !(o->unique && o->columnar) &&
+    pool_start(o, &pool);
+  /* many combinations of a URL are split over the threads */
+  bool split = combinations(o) > JOB_LINES;
+#endif
+  memset(&reader, 0, sizeof(reader));
+  reader.f = o->url;
+#ifdef USE_COMPRESSION
+  reader.detect = true;
+#endif
+  while((buffer = reader_line(o, &reader, &len))) {
+    char *eol = buffer + len;
+    if((eol > buffer) && (eol[-1] == '\r'))
+      /* CRLF detected */
+      eol--;
+
+    /* trim trailing spaces and tabs */
+    while((eol > buffer) &&
+          ((eol[-1] == ' ') || eol[-1] == '\t'))
+      eol--;
+
+    if(eol > buffer) {
+      /* if there is actual content left to deal with */
+#ifdef USE_THREADS
+      if(parallel && !split) {
+        pool_add(o, &pool, buffer, eol - buffer);
+        continue;
+      }
+#endif
+      *eol = 0; /* end of URL */
+#ifdef USE_THREADS
+      if(parallel) {
+        pool_iterate(o, &pool, buffer);
+        continue;
+      }
+#endif
+      singleurl(o, buffer);
+    }
+    else if(o->ctx->stats)
+      o->ctx->stats->skipped++;
+  }
+#ifdef USE_THREADS
+  if(parallel)
+    pool_finish(o, &pool);
+#endif
+
+#ifdef USE_COMPRESSION
+  if(reader.unpack)
+    unpack_free(reader.unpack);
+#endif
+  free(reader.buf);
+  if(o->urlopen)
+    fclose(o->url);
+}
+
+/* the URLs on the command line, with --parallel their --iterate
+   combinations are split over the threads */
+static void argurls(struct option *o)
+{
+#ifdef USE_THREADS
+  struct pool pool;
+  if(!o->url_list)
+    /* the URL made from --set */
+    o->verify = true;
+  if((o->parallel > 1) && (combinations(o) > JOB_LINES) &&
+     !(o->unique && o->columnar) && pool_start(o, &pool)) {
+    struct curl_slist *node = o->url_list;
+    if(!node)
+      pool_iterate(o, &pool, NULL);
+    for(; node; node = node->next)
+      pool_iterate(o, &pool, node->data);
+    pool_finish(o, &pool);
+    return;
+  }
+#endif
+  urllist(o);
+}
+
+/* --serve reads requests, each a list of arguments one per line ended by
+   an empty line, and answers each with a status line followed by the
+   output and the errors. The options of the latest request are kept
+   compiled and are used again as long as the requests repeat them. */
+struct server {
+  struct option *base; /* the command line options */
+  int argc;            /* the command line, added first to every request */
+  const char **argv;
+  struct option req;   /* the request being parsed */
+  struct option opt;   /* the compiled options for 'optkey' */
+  struct option run;   /* what the request runs with */
+  char *optkey;        /* the options of 'opt', one per line */
+  char *key;           /* the options of the request */
+  char *optbuf;        /* the request arguments 'opt' points into */
+  size_t optalloc;
+  bool optvalid;
+  char *buf;           /* request arguments, zero terminated */
+  size_t used;
+  size_t alloc;
+  const char **args;
+  bool *isurl;
+  int nargs;
+  int maxargs;
+  bool locale;         /* setlocale() is done */
+  struct job job;
+};
+
+/* read the next request, returns false at the end of the input */
+static bool readrequest(struct server *s, struct linereader *r)
+{
+  struct option *o = s->base;
+  bool any = false;
+  char *line;
+  size_t len;
+  char *p;
+  int i;
+  s->used = 0;
+  s->nargs = 0;
+  while((line = reader_line(o, r, &len))) {
+    any = true;
+    if(len && (line[len - 1] == '\r'))
+      len--;
+    if(!len)
+      /* end of request */
+      break;
+    if(s->used + len + 1 > s->alloc) {
+      size_t alloc = s->alloc ? s->alloc : 1024;
+      char *n;
+      while(s->used + len + 1 > alloc)
+        alloc *= 2;
+      n = realloc(s->buf, alloc);
+      if(!n)
+        errorf(o, ERROR_MEM, "out of memory");
+      s->buf = n;
+      s->alloc = alloc;
+    }
+    memcpy(&s->buf[s->used], line, len);
+    s->buf[s->used + len] = 0;
+    s->used += len + 1;
+    s->nargs++;
+  }
+  if(!any)
+    return false;
+
+  if(s->nargs + s->argc + 1 > s->maxargs) {
+    int max = (s->nargs + s->argc + 1) * 2;
+    const char **n = realloc(s->args, max * sizeof(char *));
+    bool *u;
+    if(n)
+      s->args = n;
+    u = realloc(s->isurl, max * sizeof(bool));
+    if(u)
+      s->isurl = u;
+    if(!n || !u)
+      errorf(o, ERROR_MEM, "out of memory");
+    s->maxargs = max;
+  }
+  for(i = 0, p = s->buf; i < s->nargs; i++, p += strlen(p) + 1)
+    s->args[i] = p;
+  s->args[i] = NULL;
+  return true;
+}
+
+/* parse the request into the options to run with, or use the previous
+   ones if the request has the same options */
+static void serveoptions(struct server *s)
+{
+  struct curl_slist *urls;
+  char *key;
+  size_t klen = 0;
+  int i;
+  memset(&s->req, 0, sizeof(s->req));
+  s->req.ctx = s->base->ctx;
+  parseargs(&s->req, s->argc, s->argv, NULL);
+  s->req.restricted = true;
+  parseargs(&s->req, s->nargs, s->args, s->isurl);
+
+  /* the options of this request, one per line */
+  for(i = 0; i < s->nargs; i++)
+    if(!s->isurl[i])
+      klen += strlen(s->args[i]) + 1;
+  key = s->key = malloc(klen + 1);
+  if(!key)
+    errorf(&s->req, ERROR_MEM, "out of memory");
+  for(i = 0, klen = 0; i < s->nargs; i++) {
+    if(!s->isurl[i]) {
+      size_t len = strlen(s->args[i]);
+      memcpy(&key[klen], s->args[i], len);
+      key[klen + len] = '\n';
+      klen += len + 1;
+    }
   }
-  if(o.jsonout)
-    printf("%s]\n", o.urls ? "\n" : "");
-  /* we're done with libcurl, so clean it up */
+  key[klen] = 0;
+
+  if(!s->optvalid || strcmp(key, s->optkey)) {
+    char *buf = s->optbuf;
+    size_t alloc = s->optalloc;
+    setupoptions(&s->req);
+    /* keep these options, the URLs stay with the request */
+    trurl_cleanup_options(&s->opt);
+    free(s->optkey);
+    urls = s->req.url_list;
+    s->opt = s->req;
+    s->opt.url_list = NULL;
+    memset(&s->req, 0, sizeof(s->req));
+    s->req.url_list = urls;
+    /* the options point into the request arguments */
+    s->optbuf = s->buf;
+    s->optalloc = s->alloc;
+    s->buf = buf;
+    s->alloc = alloc;
+    s->optkey = key;
+    s->key = NULL;
+    s->optvalid = true;
+    if(!s->locale && needlocale(&s->opt)) {
+      setlocale(LC_ALL, "");
+      s->locale = true;
+    }
+  }
+
+  s->run = s->opt;
+  s->run.url_list = s->req.url_list;
+  s->run.urls = 0;
+}
+
+/* run one request and write the response */
+static void serverequest(struct server *s, FILE *stream)
+{
+  struct urlctx *c = s->base->ctx;
+  struct outbuf *out = c->out;
+  struct outbuf *err = c->err;
+  struct job *job = &s->job;
+  job->out.len = job->err.len = 0;
+  job->out.oom = job->err.oom = false;
+  job->exit_code = 0;
+  job->urls = 0;
+  job->closeout = false;
+  c->out = &job->out;
+  c->err = &job->err;
+  c->job = job;
+  if(!setjmp(job->jmp)) {
+    serveoptions(s);
+    openoutput(&s->run, &job->out);
+    urllist(&s->run);
+    if(s->run.columnar)
+      colflush(&s->run);
+    showcounts(&s->run, &job->out);
+    closeoutput(&s->run, &job->out, s->run.urls);
+  }
+  else if(job->closeout)
+    closeoutput(&s->run, &job->out, job->urls);
+  urlctx_reset(c);
+  /* --unique and --count are per request */
+  urlset_free(&c->seen);
+  counter_free(&c->counts);
+  c->job = NULL;
+  c->out = out;
+  c->err = err;
+  trurl_cleanup_options(&s->req);
+  memset(&s->req, 0, sizeof(s->req));
+  free(s->key);
+  s->key = NULL;
+  memset(&s->run, 0, sizeof(s->run));
+
+  if(job->out.oom || job->err.oom)
+    errorf(s->base, ERROR_MEM, "out of memory");
+  curl_mfprintf(stream, "%d %zu %zu\n", job->exit_code, job->out.len,
+                job->err.len);
+  fwrite(job->out.buf, 1, job->out.len, stream);
+  fwrite(job->err.buf, 1, job->err.len, stream);
+  fflush(stream);
+}
+
+/* answer the requests read from 'in' until the end of it */
+static void servestream(struct server *s, FILE *in, FILE *out)
+{
+  struct linereader reader;
+  memset(&reader, 0, sizeof(reader));
+  reader.f = in;
+  while(readrequest(s, &reader))
+    serverequest(s, out);
+  free(reader.buf);
+}
+
+#ifndef _WIN32
+/* answer the requests of one client at a time on a unix socket, until
+   killed */
+static void servesocket(struct server *s, const char *path)
+{
+  struct option *o = s->base;
+  struct sockaddr_un addr;
+  size_t len = strlen(path);
+  int fd;
+  if(len >= sizeof(addr.sun_path))
+    errorf(o, ERROR_FILE, "--serve-socket path too long: %s", path);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, len + 1);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if((fd < 0) || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+     listen(fd, 16))
+    errorf(o, ERROR_FILE, "cannot listen on %s: %s", path, strerror(errno));
+
+  /* a client that goes away must not end the server */
+  signal(SIGPIPE, SIG_IGN);
+  for(;;) {
+    FILE *in;
+    FILE *out = NULL;
+    int conn = accept(fd, NULL, NULL);
+    if(conn < 0) {
+      if(errno == EINTR)
+        continue;
+      errorf(o, ERROR_FILE, "accept: %s", strerror(errno));
+    }
+    in = fdopen(conn, "rb");
+    if(in) {
+      int dupfd = dup(conn);
+      out = (dupfd < 0) ? NULL : fdopen(dupfd, "wb");
+      if(!out && (dupfd >= 0))
+        close(dupfd);
+    }
+    if(in && out)
+      servestream(s, in, out);
+    else
+      trurl_warnf(o, "client dropped: %s", strerror(errno));
+    if(out)
+      fclose(out);
+    if(in)
+      fclose(in);
+    else
+      close(conn);
+  }
+}
+#endif
+
+/* --stats counts the allocations libcurl does */
+static void countalloc(void)
+{
+#if defined(USE_THREADS) && defined(__GNUC__)
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+#else
+  allocs++;
+#endif
+}
+
+static void *stats_malloc(size_t size)
+{
+  countalloc();
+  return malloc(size);
+}
+
+static void *stats_calloc(size_t nmemb, size_t size)
+{
+  countalloc();
+  return calloc(nmemb, size);
+}
+
+static void *stats_realloc(void *ptr, size_t size)
+{
+  countalloc();
+  return realloc(ptr, size);
+}
+
+static char *stats_strdup(const char *str)
+{
+  countalloc();
+  return strdup(str);
+}
+
+static void stats_free(void *ptr)
+{
+  free(ptr);
+}
+
+static void serve(struct option *o, int argc, const char **argv,
+                  bool locale)
+{
+  struct server s;
+  if(o->url || o->url_list)
+    errorf(o, ERROR_FLAG, "--serve takes the URLs from the requests");
+  memset(&s, 0, sizeof(s));
+  s.locale = locale;
+  s.base = o;
+  s.argc = argc;
+  s.argv = argv;
+  out_init(&s.job.out, NULL);
+  out_init(&s.job.err, NULL);
+#ifndef _WIN32
+  if(o->socket)
+    servesocket(&s, o->socket);
+  else
+#else
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    servestream(&s, stdin, stdout);
+  trurl_cleanup_options(&s.opt);
+  free(s.optkey);
+  free(s.optbuf);
+  free(s.buf);
+  free(s.args);
+  free(s.isurl);
+  out_free(&s.job.out);
+  out_free(&s.job.err);
+}
+
+int main(int argc, const char **argv)
+{
+  int exit_status = 0;
+  struct option o;
+  static struct urlctx ctx;
+  struct outbuf out;
+  struct outbuf err;
+  uint64_t start = nanotime();
+  uint64_t parsed;
+  uint64_t ready;
+  bool locale = false;
+  memset(&o, 0, sizeof(o));
+  out_init(&out, stdout);
+  memset(&err, 0, sizeof(err));
+  err.stream = stderr;
+  ctx.out = &out;
+  ctx.err = &err;
+  o.ctx = &ctx;
+  /* The URL API needs no curl_global_init(), which would initialize TLS
+     and more that trurl does not use */
+
+  parseargs(&o, argc - 1, &argv[1], NULL);
+  setupoptions(&o);
+  if(o.stats) {
+    ctx.stats = calloc(1, sizeof(struct stats));
+    if(!ctx.stats)
+      errorf(&o, ERROR_MEM, "out of memory");
+    /* only done with --stats, this is what curl_global_init() costs */
+    curl_global_init_mem(CURL_GLOBAL_NOTHING, stats_malloc, stats_free,
+                         stats_realloc, stats_strdup, stats_calloc);
+  }
+  parsed = nanotime();
+  if(needlocale(&o)) {
+    setlocale(LC_ALL, "");
+    locale = true;
+  }
+  ready = nanotime();
+  if(o.startup_stats) {
+    char stats[128];
+    curl_msnprintf(stats, sizeof(stats),
+                   "{\"options_us\":%.1f,\"locale_us\":%.1f,"
+                   "\"locale\":%s}\n",
+                   (double)(parsed - start) / 1000,
+                   (double)(ready - parsed) / 1000,
+                   locale ? "true" : "false");
+    out_str(&err, stats);
+    out_flush(&err);
+  }
+
+  if(o.serve)
+    serve(&o, argc - 1, &argv[1], locale);
+  else {
+#ifdef _WIN32
+    if(o.columnar || o.compress)
+      _setmode(_fileno(stdout), _O_BINARY);
+#endif
+#ifdef USE_COMPRESSION
+    if(o.compress)
+      pack_start(&o, &out);
+#endif
+    openoutput(&o, &out);
+    if(o.url)
+      /* this is a file to read URLs from */
+      readurls(&o);
+    else
+      /* not reading URLs from a file */
+      argurls(&o);
+    if(o.columnar)
+      colflush(&o);
+    showcounts(&o, &out);
+    closeoutput(&o, &out, o.urls);
+  }
+  showstats(&o);
+  out_flush(&out);
+#ifdef USE_COMPRESSION
+  pack_end(&out);
+#endif
+  out_free(&out);
+  urlctx_cleanup(&ctx);
   trurl_cleanup_options(&o);
-  curl_global_cleanup();
   return exit_status;
 }
+#else /* TRURL_LIBRARY */
+
+struct trurl {
+  struct option opt; /* parsed and compiled */
+  struct option run; /* the copy a batch runs with */
+  struct urlctx ctx;
+  struct outbuf out;
+  struct outbuf err;
+  struct job job;
+};
+
+static void discard(void *userp, const char *data, size_t len)
+{
+  (void)userp;
+  (void)data;
+  (void)len;
+}
+
+/* send the output and the notes to the sink, and make errors end the
+   call */
+static void lib_begin(struct trurl *t, const struct trurl_sink *sink)
+{
+  t->ctx.out = &t->out;
+  t->ctx.err = &t->err;
+  t->out.sink = (sink && sink->output) ? sink->output : discard;
+  t->err.sink = (sink && sink->notes) ? sink->notes : discard;
+  t->out.userp = t->err.userp = sink ? sink->userp : NULL;
+  t->job.exit_code = 0;
+  t->job.urls = 0;
+  t->job.closeout = false;
+  t->ctx.job = &t->job;
+}
+
+static trurl_code lib_end(struct trurl *t)
+{
+  out_flush(&t->out);
+  urlctx_reset(&t->ctx);
+  t->ctx.job = NULL;
+  return (trurl_code)t->job.exit_code;
+}
+
+trurl_code trurl_new(struct trurl **tp, int argc, const char **argv,
+                     const struct trurl_sink *sink)
+{
+  struct trurl *t = calloc(1, sizeof(*t));
+  trurl_code rc;
+  *tp = NULL;
+  if(!t)
+    return TRURL_E_MEM;
+  out_init(&t->out, NULL);
+  if(!t->out.buf) {
+    free(t);
+    return TRURL_E_MEM;
+  }
+  t->ctx.out = &t->out;
+  t->ctx.err = &t->err;
+  t->opt.ctx = &t->ctx;
+  t->opt.restricted = true;
+  lib_begin(t, sink);
+  if(!setjmp(t->job.jmp)) {
+    parseargs(&t->opt, argc, argv, NULL);
+    if(t->opt.url_list)
+      errorf(&t->opt, ERROR_FLAG,
+             "the URLs are passed to trurl_process_batch()");
+    setupoptions(&t->opt);
+  }
+  rc = lib_end(t);
+  if(rc)
+    trurl_free(t);
+  else
+    *tp = t;
+  return rc;
+}
+
+trurl_code trurl_process_batch(struct trurl *t, const char **urls, size_t n,
+                               const struct trurl_sink *sink)
+{
+  struct option *o = &t->run;
+  lib_begin(t, sink);
+  t->run = t->opt;
+  if(!setjmp(t->job.jmp)) {
+    size_t i;
+    openoutput(o, &t->out);
+    if(!n)
+      /* make one from the --set components */
+      urllist(o);
+    for(i = 0; i < n; i++)
+      singleurl(o, urls[i]);
+    if(o->columnar)
+      colflush(o);
+    showcounts(o, &t->out);
+    closeoutput(o, &t->out, o->urls);
+  }
+  else if(t->job.closeout)
+    closeoutput(o, &t->out, t->job.urls);
+  /* --count is per batch */
+  counter_free(&t->ctx.counts);
+  return lib_end(t);
+}
+
+void trurl_free(struct trurl *t)
+{
+  if(t) {
+    urlctx_cleanup(&t->ctx);
+    trurl_cleanup_options(&t->opt);
+    out_free(&t->out);
+    free(t);
+  }
+}
+#endif /* TRURL_LIBRARY */